@@ -5,34 +5,25 @@
  */
 
 #include "decoder.hpp"
+#include "nal_unit.hpp"
+#include "rtcp_feedback.hpp"
 #include "video_frame.hpp"
 
 #include <array>
+#include <chrono>
+#include <ctime>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <string>
+#include <vector>
 
 using namespace rtspcam;
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " <h264 file>" << std::endl;
-        return 0;
-    }
-
-    Swapper<VideoFramePtr> swapper(make_videoframe());
-    Decoder decoder(swapper);
-
+// Sends the whole file, the decoder has finished it once it is destroyed.
+static void decode_file(std::ifstream& is, Decoder& decoder) {
     constexpr size_t buffer_size = 4096;
     std::array<uint8_t, buffer_size + AV_INPUT_BUFFER_PADDING_SIZE> buffer;
 
-    std::ifstream is(argv[1], std::ios::binary);
-    if (!is) {
-        std::ostringstream os;
-        std::cerr << "failed to open h264 file `" << argv[1] << "`" << std::endl;
-        return 1;
-    }
-
     bool eof = false;
 
     do {
@@ -41,5 +32,130 @@ int main(int argc, char* argv[]) {
         eof = bread == 0;
 
         decoder.send({buffer.data(), (size_t)bread}, 0);
-    } while (!eof); 
+    } while (!eof);
+}
+
+// Compares the keyframe request against one put together by hand from RFC 3550, 4585 and 5104.
+static bool check_keyframe_request() {
+    std::vector<uint8_t> expected = {
+        // receiver report, no report blocks
+        0x80, 0xc9, 0x00, 0x01, 0x11, 0x22, 0x33, 0x44,
+        // SDES, CNAME "cam" and one null octet, padded to 32 bits
+        0x81, 0xca, 0x00, 0x03, 0x11, 0x22, 0x33, 0x44,
+        0x01, 0x03, 'c', 'a', 'm', 0x00, 0x00, 0x00,
+        // PLI
+        0x81, 0xce, 0x00, 0x02, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+        // FIR, sequence 7
+        0x84, 0xce, 0x00, 0x04, 0x11, 0x22, 0x33, 0x44, 0x00, 0x00, 0x00, 0x00,
+        0x55, 0x66, 0x77, 0x88, 0x07, 0x00, 0x00, 0x00,
+    };
+    if (make_keyframe_request(0x11223344, 0x55667788, 7, "cam") != expected) {
+        std::cerr << "keyframe request differs" << std::endl;
+        return false;
+    }
+
+    // a CNAME filling its item exactly still needs a null octet, which takes another word
+    if (make_keyframe_request(1, 2, 0, "ab").size() != 56) {
+        std::cerr << "keyframe request is padded wrong" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool check_classify_nal() {
+    struct Case {
+        VideoCodec codec;
+        uint8_t header;
+        NalKind kind;
+    };
+    Case const cases[] = {
+        { VideoCodec::H264, 0x67, NalKind::PARAMETER_SET }, // SPS
+        { VideoCodec::H264, 0x68, NalKind::PARAMETER_SET }, // PPS
+        { VideoCodec::H264, 0x65, NalKind::KEYFRAME }, // IDR slice
+        { VideoCodec::H264, 0x41, NalKind::FRAME }, // non-IDR slice
+        { VideoCodec::H264, 0x06, NalKind::OTHER }, // SEI
+        { VideoCodec::H264, 0x09, NalKind::OTHER }, // AUD
+        { VideoCodec::H265, 0x40, NalKind::PARAMETER_SET }, // VPS
+        { VideoCodec::H265, 0x42, NalKind::PARAMETER_SET }, // SPS
+        { VideoCodec::H265, 0x44, NalKind::PARAMETER_SET }, // PPS
+        { VideoCodec::H265, 0x20, NalKind::KEYFRAME }, // BLA_W_LP
+        { VideoCodec::H265, 0x26, NalKind::KEYFRAME }, // IDR_W_RADL
+        { VideoCodec::H265, 0x2a, NalKind::KEYFRAME }, // CRA
+        { VideoCodec::H265, 0x02, NalKind::FRAME }, // TRAIL_R
+        { VideoCodec::H265, 0x46, NalKind::OTHER }, // AUD
+        { VideoCodec::H265, 0x4e, NalKind::OTHER }, // prefix SEI
+    };
+
+    bool ok = true;
+    for (auto const& c : cases) {
+        if (classify_nal(c.codec, c.header) != c.kind) {
+            std::cerr << "NAL header 0x" << std::hex << (int)c.header << std::dec << " of "
+                      << (c.codec == VideoCodec::H265 ? "h265" : "h264") << " is misclassified" << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Decodes the file and prints throughput and process CPU time (all threads on POSIX). With
+// `gray` the decoder skips chroma, where libavcodec was built with --enable-gray.
+static bool decode(std::string const& path, bool is_h265, bool gray) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is) {
+        std::cerr << "failed to open file `" << path << "`" << std::endl;
+        return false;
+    }
+
+    FrameChannel channel;
+    DecoderControl control;
+    ErrorSlot error_slot;
+    control.gray_ = gray;
+
+    auto cpu_start = std::clock();
+    auto start = std::chrono::steady_clock::now();
+    {
+        Decoder decoder(channel, control, error_slot, is_h265 ? VideoCodec::H265 : VideoCodec::H264);
+        decode_file(is, decoder);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    std::cout << (is_h265 ? "h265" : "h264") << (gray ? " luma only" : "") << ": " << control.packets_decoded_
+              << " packets in " << seconds << " s, " << control.packets_decoded_ / seconds << " packets/s, cpu "
+              << cpu << " s, " << control.decode_errors_ << " errors" << std::endl;
+    if (auto error = error_slot.check()) {
+        std::cerr << *error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3 || (argc == 3 && std::string(argv[1]) != "--gray")) {
+        std::cout << "Usage: " << argv[0] << " <h264 or h265 file>" << std::endl;
+        std::cout << "       " << argv[0] << " --gray <h264 or h265 file>" << std::endl;
+        std::cout << "       " << argv[0] << " --check" << std::endl;
+        return 0;
+    }
+
+    // checks of the packet and NAL logic that need no stream
+    if (std::string(argv[1]) == "--check") {
+        bool ok = check_keyframe_request();
+        ok = check_classify_nal() && ok;
+        std::cout << (ok ? "checks passed" : "checks failed") << std::endl;
+        return ok ? 0 : 1;
+    }
+
+    // annex B streams, told apart by the extension
+    std::string path = argv[argc - 1];
+    bool is_h265 = path.size() > 5
+        && (path.compare(path.size() - 5, 5, ".h265") == 0 || path.compare(path.size() - 5, 5, ".hevc") == 0);
+
+    // --gray decodes the file twice, so the CPU time of luma-only decoding can be compared
+    if (!decode(path, is_h265, false)) {
+        return 1;
+    }
+    if (argc == 3 && !decode(path, is_h265, true)) {
+        return 1;
+    }
 }
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Measures how long it takes until many streams have their first frame, opening them one after
+// the other and all at once. Meant for a local RTSP server serving the same stream to every
+// session, e.g. live555MediaServer or mediamtx on the loopback interface.
+
+#include "rtsp_camera.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace rtspcam;
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(char const* name, double total, std::vector<std::unique_ptr<RtspCamera>>& cameras)
+{
+    // first frames relative to each stream's own DESCRIBE
+    std::vector<int64_t> first_frames;
+    for (auto& camera : cameras) {
+        first_frames.push_back(camera->stats().startup_.first_frame_);
+    }
+    std::sort(first_frames.begin(), first_frames.end());
+
+    std::cout << name << ": " << cameras.size() << " streams in " << total << " s, first frame after "
+              << first_frames[first_frames.size() / 2] / 1000 << " ms median, "
+              << first_frames.back() / 1000 << " ms max" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <url> [streams] [max handshakes]" << std::endl;
+        return 0;
+    }
+
+    size_t num_streams = argc > 2 ? std::stoul(argv[2]) : 100;
+    OpenOptions options;
+    if (argc > 3) {
+        options.max_handshakes_ = std::stoul(argv[3]);
+    }
+    std::vector<std::string> urls(num_streams, argv[1]);
+
+    try {
+        {
+            auto start = Clock::now();
+            std::vector<std::unique_ptr<RtspCamera>> cameras;
+            for (auto const& url : urls) {
+                cameras.push_back(RtspCamera::open(url));
+                cameras.back()->started().get();
+            }
+            report("one by one", seconds_since(start), cameras);
+        }
+
+        {
+            auto start = Clock::now();
+            auto cameras = RtspCamera::open_all(urls, options);
+            for (auto& camera : cameras) {
+                camera->started().get();
+            }
+            report("open_all", seconds_since(start), cameras);
+        }
+    } catch (std::runtime_error const& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Measures CPU time of the whole process while reading a stream at several output rates, with and
+// without discarding non-reference frames in the decoder, and in keyframe-only mode.
+
+#include "rtsp_camera.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/resource.h>
+
+using namespace rtspcam;
+
+static double cpu_seconds()
+{
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6
+        + (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+enum class Mode {
+    FULL,
+    DROP_NONREF,
+    KEYFRAMES_ONLY,
+};
+
+static void run(std::string const& url, double fps, Mode mode, std::chrono::seconds duration)
+{
+    auto camera = RtspCamera::open(url);
+    camera->set_max_rate(fps, mode == Mode::DROP_NONREF);
+    camera->set_keyframes_only(mode == Mode::KEYFRAMES_ONLY);
+
+    // the first image pays for the handshake and decoder setup
+    camera->read();
+    auto before = camera->stats();
+
+    double cpu_start = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    int images = 0;
+    while (std::chrono::steady_clock::now() - start < duration) {
+        camera->read();
+        images += 1;
+    }
+    double cpu = cpu_seconds() - cpu_start;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto after = camera->stats();
+
+    char const* mode_name = mode == Mode::DROP_NONREF ? " (drop non-ref)"
+        : mode == Mode::KEYFRAMES_ONLY                ? " (keyframes only)"
+                                                      : "";
+    std::cout << fps << " fps" << mode_name << ": " << images / wall << " images/s, cpu " << 100.0 * cpu / wall << "%, decoded "
+              << after.frames_decoded_ - before.frames_decoded_ << " of "
+              << after.packets_decoded_ - before.packets_decoded_ << " packets, decimated "
+              << after.frames_decimated_ - before.frames_decimated_ << ", discarded "
+              << after.units_discarded_ - before.units_discarded_ << " nal units" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <url> [seconds]" << std::endl;
+        return 0;
+    }
+
+    std::chrono::seconds duration(argc > 2 ? std::stoi(argv[2]) : 20);
+
+    try {
+        for (double fps : { 1.0, 5.0, 25.0 }) {
+            run(argv[1], fps, Mode::FULL, duration);
+            run(argv[1], fps, Mode::DROP_NONREF, duration);
+        }
+        // against full decode at the same rate, images come at the stream's keyframe interval
+        run(argv[1], 1.0, Mode::KEYFRAMES_ONLY, duration);
+    } catch (std::runtime_error const& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Compares handing frames to another process through the shared memory ring with copying them
+// through a unix socket. A forked reader touches every cache line of each frame and acknowledges
+// it over a pipe, the writer measures the round trip.
+
+#include "shm_ring.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace rtspcam;
+
+static constexpr int width = 1920;
+static constexpr int height = 1080;
+static constexpr size_t frame_size = (size_t)width * height * 3;
+
+static uint8_t touch(uint8_t const* data, size_t size)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < size; i += 64) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static bool read_fully(int fd, uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        auto n = read(fd, data, size);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, uint8_t const* data, size_t size)
+{
+    while (size > 0) {
+        auto n = write(fd, data, size);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static void report(char const* name, int num_frames, std::chrono::steady_clock::duration elapsed)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    std::cout << name << ": " << (double)us / num_frames << " us per frame, "
+              << (double)num_frames * 1e6 / us << " frames/s" << std::endl;
+}
+
+static void run_shm(int num_frames, std::vector<uint8_t>& pixels)
+{
+    std::string const name = "/rtspcam-bench-" + std::to_string(getpid());
+    ShmRingWriter writer(name, frame_size);
+
+    int ack[2];
+    if (pipe(ack) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(ack[0]);
+        ShmRingReader reader(name);
+        std::optional<uint64_t> sequence;
+        for (int i = 0; i < num_frames; i++) {
+            auto frame = reader.wait(sequence, std::chrono::milliseconds(1000));
+            if (!frame) {
+                _exit(1);
+            }
+            uint8_t sum = touch(frame->data_, frame->size_);
+            sequence = frame->sequence_;
+            write_fully(ack[1], &sum, 1);
+        }
+        _exit(0);
+    }
+    close(ack[1]);
+
+    Image image(pixels.data(), pixels.size(), 0, width, height, width * 3, ImageFormat::BGR);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_frames; i++) {
+        image.frame_index_ = i;
+        writer.write(image);
+        uint8_t sum;
+        read_fully(ack[0], &sum, 1);
+    }
+    report("shared memory ring", num_frames, std::chrono::steady_clock::now() - start);
+
+    close(ack[0]);
+    waitpid(pid, nullptr, 0);
+}
+
+static void run_socket(int num_frames, std::vector<uint8_t>& pixels)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::vector<uint8_t> frame(frame_size);
+        for (int i = 0; i < num_frames; i++) {
+            if (!read_fully(fds[1], frame.data(), frame.size())) {
+                _exit(1);
+            }
+            uint8_t sum = touch(frame.data(), frame.size());
+            write_fully(fds[1], &sum, 1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_frames; i++) {
+        write_fully(fds[0], pixels.data(), pixels.size());
+        uint8_t sum;
+        read_fully(fds[0], &sum, 1);
+    }
+    report("unix socket copy", num_frames, std::chrono::steady_clock::now() - start);
+
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char* argv[])
+{
+    int num_frames = argc > 1 ? std::stoi(argv[1]) : 500;
+
+    std::vector<uint8_t> pixels(frame_size);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = (uint8_t)i;
+    }
+
+    std::cout << num_frames << " frames of " << width << "x" << height << " bgr" << std::endl;
+    run_shm(num_frames, pixels);
+    run_socket(num_frames, pixels);
+}
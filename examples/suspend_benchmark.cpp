@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Prints how long a stream took to start, then lets it pause for being idle and measures how long
+// the next read takes to resume it.
+
+#include "rtsp_camera.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace rtspcam;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <url> [rounds]" << std::endl;
+        return 0;
+    }
+
+    int rounds = argc > 2 ? std::stoi(argv[2]) : 5;
+    std::chrono::seconds const idle_timeout(2);
+
+    try {
+        auto camera = RtspCamera::open(argv[1]);
+        camera->set_idle_timeout(idle_timeout);
+        camera->read();
+
+        auto startup = camera->stats().startup_;
+        std::cout << "startup (ms after DESCRIBE): described " << startup.described_ / 1000
+                  << ", playing " << startup.playing_ / 1000 << ", first packet "
+                  << startup.first_packet_ / 1000 << ", first keyframe "
+                  << startup.first_keyframe_ / 1000 << ", first frame " << startup.first_frame_ / 1000
+                  << ", first read " << startup.first_read_ / 1000 << std::endl;
+
+        for (int i = 0; i < rounds; i++) {
+            std::this_thread::sleep_for(idle_timeout * 2);
+            if (!camera->stats().is_suspended_) {
+                std::cout << "stream did not pause" << std::endl;
+                return 1;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            camera->read();
+            auto elapsed = std::chrono::steady_clock::now() - start;
+
+            auto stats = camera->stats();
+            std::cout << "resume " << i << ": read took "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+                      << " ms, first frame after " << stats.resume_latency_ / 1000 << " ms"
+                      << std::endl;
+        }
+    } catch (std::runtime_error const& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -8,59 +8,888 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "camera_set.hpp"
+#include "governor.hpp"
 #include "rtsp_camera.hpp"
+#ifndef _WIN32
+#include "shm_ring.hpp"
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 namespace py = pybind11;
 
+// DLPack ABI (dlpack.h), just enough to export cpu uint8 tensors.
+struct DLDevice {
+    int32_t device_type;
+    int32_t device_id;
+};
+struct DLDataType {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+};
+struct DLTensor {
+    void* data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t* shape;
+    int64_t* strides;
+    uint64_t byte_offset;
+};
+struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void* manager_ctx;
+    void (*deleter)(DLManagedTensor* self);
+};
+
+static constexpr int32_t dl_device_cpu = 1;
+static constexpr uint8_t dl_type_uint = 1;
+
+// An image together with its metadata. Exports its pixels through the buffer protocol and DLPack
+// without copies, the image keeps them alive.
+class PyFrame {
+public:
+    explicit PyFrame(rtspcam::Image image)
+        : image_(std::move(image))
+    {
+    }
+
+    std::vector<py::ssize_t> shape() const;
+    std::vector<py::ssize_t> strides() const;
+
+    rtspcam::Image image_;
+};
+
+#ifdef __linux__
+// eventfd signalled by the camera's ready callback, closed once the callback is gone
+struct ReadyFd {
+    ReadyFd()
+        : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (fd_ < 0) {
+            throw std::runtime_error("Failed to create eventfd");
+        }
+    }
+    ~ReadyFd() { close(fd_); }
+
+    void signal() const
+    {
+        uint64_t value = 1;
+        [[maybe_unused]] auto ret = write(fd_, &value, sizeof(value));
+    }
+
+    void drain() const
+    {
+        uint64_t value;
+        [[maybe_unused]] auto ret = read(fd_, &value, sizeof(value));
+    }
+
+    int const fd_;
+};
+#endif
+
 class PyCam {
 public:
     PyCam(std::string const& url);
+    PyCam(std::unique_ptr<rtspcam::RtspCamera> handle);
     py::array_t<uint8_t> read();
+    PyFrame read_frame();
+    py::dict read_raw();
+    py::array read_tensor(rtspcam::TensorFormat const& format);
+    py::dict read_outputs();
+    void set_image_format(rtspcam::ImageFormat format);
+    void set_roi(std::optional<rtspcam::Rect> const& roi);
+    void add_output(std::string const& name, rtspcam::OutputSpec const& spec);
+    void remove_output(std::string const& name);
+    void set_output_roi(std::string const& name, rtspcam::Rect const& roi);
+    PyCam subscribe(rtspcam::Delivery const& delivery);
+    uint64_t skipped_frames();
+    void set_delivery(rtspcam::Delivery const& delivery);
+    void set_max_rate(double fps, bool drop_nonref);
+    void set_keyframes_only(bool keyframes_only);
+    void set_priority(int priority);
+    void set_idle_timeout(double seconds);
+    void set_reconnect(std::optional<rtspcam::ReconnectPolicy> const& policy);
+    void set_loss_policy(rtspcam::LossPolicy policy);
+    void set_error_budget(int errors);
+    void set_prefetch(bool prefetch);
+    void set_size(int width, int height);
+    void set_conversion_threads(int num_threads);
+    rtspcam::CameraStats stats();
+    bool wait_started(std::optional<double> timeout);
+    bool is_ready();
+    int fileno();
+    void drain_ready();
+    rtspcam::RtspCamera& camera() { return *handle_; }
 
 private:
     std::unique_ptr<rtspcam::RtspCamera> handle_;
+#ifdef __linux__
+    std::shared_ptr<ReadyFd> ready_fd_;
+#endif
+};
+
+class PyCameraSet {
+public:
+    size_t add(PyCam& camera);
+    std::vector<size_t> wait(std::optional<int> timeout_ms);
+    int fd() const;
+    py::tuple read_batch(int width, int height, rtspcam::ImageFormat format);
+
+private:
+    rtspcam::CameraSet handle_;
 };
 
 PyCam::PyCam(std::string const& url)
-    : handle_(rtspcam::RtspCamera::open(url))
+    : PyCam(rtspcam::RtspCamera::open(url))
+{
+}
+
+PyCam::PyCam(std::unique_ptr<rtspcam::RtspCamera> handle)
+    : handle_(std::move(handle))
 {
     handle_->set_image_format(rtspcam::ImageFormat::BGR);
 }
 
+// Returns a view of the image's pixels, no data is copied. The array's base is a capsule holding a
+// copy of the image, so the pooled buffer stays alive for as long as the array (or a view of it)
+// does, and further reads never overwrite it. Shared pixels, e.g. the decoder's luma plane, come
+// as a read-only array.
+static py::array_t<uint8_t> to_array(rtspcam::Image const& image_header)
+{
+    py::ssize_t width = image_header.width_;
+    py::ssize_t height = image_header.height_;
+    py::ssize_t stride = image_header.stride_;
+    py::ssize_t channels = image_header.channels();
+
+    auto owner = std::make_unique<rtspcam::Image>(image_header);
+    py::capsule base(owner.get(), [](void* p) { delete static_cast<rtspcam::Image*>(p); });
+    owner.release();
+
+    py::array_t<uint8_t> array;
+    if (channels == 1) {
+        // the luma plane is returned as is, its rows may be padded
+        array = py::array_t<uint8_t>({ height, width }, { stride, (py::ssize_t)1 }, image_header.data_, base);
+    } else {
+        array = py::array_t<uint8_t>({ height, width, channels }, { stride, channels, (py::ssize_t)1 },
+            image_header.data_, base);
+    }
+    if (image_header.is_shared_) {
+        array.attr("setflags")(py::arg("write") = false);
+    }
+    return array;
+}
+
 py::array_t<uint8_t> PyCam::read()
 {
-    auto image_header = handle_->read();
-    int width = image_header.width_;
-    int height = image_header.height_;
+    std::optional<rtspcam::Image> image;
+    {
+        // other python threads, e.g. reading other cameras, run while this one waits
+        py::gil_scoped_release release;
+        image = handle_->read();
+    }
+    return to_array(image.value());
+}
+
+PyFrame PyCam::read_frame()
+{
+    std::optional<rtspcam::Image> image;
+    {
+        py::gil_scoped_release release;
+        image = handle_->read();
+    }
+    return PyFrame(std::move(image.value()));
+}
 
-    // FIXME(bostjan): Check stride
-    assert(image_header.size_ == width * height * 3);
-    assert(image_header.stride_ == width * 3);
+py::dict PyCam::read_raw()
+{
+    std::optional<rtspcam::RawFrame> raw;
+    {
+        py::gil_scoped_release release;
+        raw = handle_->read_raw();
+    }
 
-    // allocate and copy image data
-    // py::array_t<uint8_t> image({height, width, 3});
-    // std::copy(image_header.data_, image_header.data_ + image_header.size_,
-    // image.mutable_data(0));
+    // planes are 2d views, interleaved chroma (e.g. nv12) comes as rows of u, v pairs. They are the
+    // decoder's reference frames, so they are read-only.
+    auto owner = std::make_unique<rtspcam::RawFrame>(raw.value());
+    py::capsule base(owner.get(), [](void* p) { delete static_cast<rtspcam::RawFrame*>(p); });
+    owner.release();
 
-    // avoid allocation and copying
-    auto buffer_info = py::buffer_info(image_header.data_, { height, width, 3 },
-        { width * 3, 3, 1 } /* readonly = false */);
-    py::array_t<uint8_t> image(buffer_info);
+    py::list planes;
+    for (int i = 0; i < raw->num_planes_; i++) {
+        py::array_t<uint8_t> plane({ (py::ssize_t)raw->rows_[i], (py::ssize_t)raw->row_size_[i] },
+            { (py::ssize_t)raw->stride_[i], (py::ssize_t)1 }, raw->data_[i], base);
+        plane.attr("setflags")(py::arg("write") = false);
+        planes.append(plane);
+    }
 
-    return image;
+    py::dict result;
+    result["planes"] = planes;
+    result["pixel_format"] = raw->pixel_format_;
+    result["width"] = raw->width_;
+    result["height"] = raw->height_;
+    result["frame_index"] = raw->frame_index_;
+    result["timestamp"] = raw->timestamp_;
+    result["skipped"] = raw->skipped_;
+    result["is_corrupt"] = raw->is_corrupt_;
+    return result;
 }
 
-static PyCam pycam_open(std::string const& url)
+py::dict PyCam::read_outputs()
 {
-    return PyCam(url);
+    std::map<std::string, rtspcam::Image> outputs;
+    {
+        py::gil_scoped_release release;
+        outputs = handle_->read_outputs();
+    }
+
+    py::dict images;
+    for (auto const& [name, image_header] : outputs) {
+        images[py::str(name)] = to_array(image_header);
+    }
+    return images;
+}
+
+py::array PyCam::read_tensor(rtspcam::TensorFormat const& format)
+{
+    // the tensor is sized from the frame `read_tensor` will convert, `peek` doesn't convert it
+    std::optional<rtspcam::Image> image;
+    {
+        py::gil_scoped_release release;
+        image = handle_->peek();
+    }
+
+    auto const& image_header = image.value();
+    py::ssize_t width = image_header.width_;
+    py::ssize_t height = image_header.height_;
+    py::ssize_t channels = image_header.channels();
+    size_t nbytes = rtspcam::tensor_size(image_header, format);
+
+    std::vector<py::ssize_t> shape;
+    if (format.layout_ == rtspcam::TensorLayout::NCHW) {
+        shape = { channels, height, width };
+    } else {
+        shape = { height, width, channels };
+    }
+
+    auto dtype = format.type_ == rtspcam::TensorType::FLOAT32 ? py::dtype::of<float>()
+                                                              : py::dtype("float16");
+    py::array tensor(dtype, shape);
+    void* tensor_data = tensor.mutable_data();
+    {
+        py::gil_scoped_release release;
+        handle_->read_tensor(tensor_data, nbytes, format);
+    }
+
+    return tensor;
+}
+
+void PyCam::set_image_format(rtspcam::ImageFormat format)
+{
+    handle_->set_image_format(format);
+}
+
+void PyCam::set_roi(std::optional<rtspcam::Rect> const& roi)
+{
+    handle_->set_roi(roi);
+}
+
+void PyCam::add_output(std::string const& name, rtspcam::OutputSpec const& spec)
+{
+    handle_->add_output(name, spec);
+}
+
+void PyCam::remove_output(std::string const& name)
+{
+    handle_->remove_output(name);
+}
+
+void PyCam::set_output_roi(std::string const& name, rtspcam::Rect const& roi)
+{
+    handle_->set_roi(name, roi);
+}
+
+PyCam PyCam::subscribe(rtspcam::Delivery const& delivery)
+{
+    return PyCam(handle_->subscribe(delivery));
+}
+
+uint64_t PyCam::skipped_frames()
+{
+    return handle_->skipped_frames();
+}
+
+void PyCam::set_delivery(rtspcam::Delivery const& delivery)
+{
+    handle_->set_delivery(delivery);
+}
+
+void PyCam::set_max_rate(double fps, bool drop_nonref)
+{
+    handle_->set_max_rate(fps, drop_nonref);
+}
+
+void PyCam::set_keyframes_only(bool keyframes_only)
+{
+    handle_->set_keyframes_only(keyframes_only);
+}
+
+void PyCam::set_priority(int priority)
+{
+    handle_->set_priority(priority);
+}
+
+void PyCam::set_idle_timeout(double seconds)
+{
+    handle_->set_idle_timeout(std::chrono::milliseconds((int64_t)(seconds * 1000)));
+}
+
+void PyCam::set_reconnect(std::optional<rtspcam::ReconnectPolicy> const& policy)
+{
+    handle_->set_reconnect(policy);
+}
+
+void PyCam::set_loss_policy(rtspcam::LossPolicy policy)
+{
+    handle_->set_loss_policy(policy);
+}
+
+void PyCam::set_error_budget(int errors)
+{
+    handle_->set_error_budget(errors);
+}
+
+// Returns false if the camera has no frame yet after `timeout` seconds, raises the error that ended
+// the stream before its first frame.
+bool PyCam::wait_started(std::optional<double> timeout)
+{
+    auto started = handle_->started();
+    {
+        py::gil_scoped_release release;
+        if (!timeout) {
+            started.wait();
+        } else if (started.wait_for(std::chrono::duration<double>(timeout.value())) != std::future_status::ready) {
+            return false;
+        }
+    }
+    started.get();
+    return true;
+}
+
+void PyCam::set_prefetch(bool prefetch)
+{
+    handle_->set_pipelined(prefetch);
+}
+
+void PyCam::set_size(int width, int height)
+{
+    handle_->set_size(width, height);
+}
+
+void PyCam::set_conversion_threads(int num_threads)
+{
+    handle_->set_conversion_threads(num_threads);
+}
+
+rtspcam::CameraStats PyCam::stats()
+{
+    return handle_->stats();
+}
+
+bool PyCam::is_ready()
+{
+    return handle_->is_ready();
+}
+
+int PyCam::fileno()
+{
+#ifdef __linux__
+    if (!ready_fd_) {
+        // the callback shares the fd, so it stays open until the camera drops the callback
+        ready_fd_ = std::make_shared<ReadyFd>();
+        handle_->set_ready_callback([ready_fd = ready_fd_]() { ready_fd->signal(); });
+    }
+    return ready_fd_->fd_;
+#else
+    throw std::runtime_error("Pollable cameras need eventfd, which is not available");
+#endif
+}
+
+void PyCam::drain_ready()
+{
+#ifdef __linux__
+    if (ready_fd_) {
+        ready_fd_->drain();
+    }
+#endif
+}
+
+// Returns an asyncio future resolved with the next image. The camera's eventfd is watched by the
+// running loop, so waiting takes no thread. Only one read may be pending per camera.
+static py::object pycam_read_async(py::object self)
+{
+    auto& camera = self.cast<PyCam&>();
+    auto loop = py::module_::import("asyncio").attr("get_running_loop")();
+    auto future = loop.attr("create_future")();
+
+    // the fd must exist before checking, so that a frame arriving in between signals it
+    int fd = camera.fileno();
+    if (camera.is_ready()) {
+        future.attr("set_result")(camera.read());
+        return future;
+    }
+
+    auto on_readable = py::cpp_function([self, loop, future, fd]() {
+        auto& camera = self.cast<PyCam&>();
+        camera.drain_ready();
+
+        if (future.attr("done")().cast<bool>()) {
+            // cancelled
+            loop.attr("remove_reader")(fd);
+            return;
+        }
+        if (!camera.is_ready()) {
+            return;
+        }
+
+        loop.attr("remove_reader")(fd);
+        try {
+            future.attr("set_result")(camera.read());
+        } catch (std::exception const& e) {
+            future.attr("set_exception")(py::module_::import("builtins").attr("RuntimeError")(e.what()));
+        }
+    });
+
+    loop.attr("add_reader")(fd, on_readable);
+    return future;
+}
+
+std::vector<py::ssize_t> PyFrame::shape() const
+{
+    if (image_.channels() == 1) {
+        return { image_.height_, image_.width_ };
+    }
+    return { image_.height_, image_.width_, image_.channels() };
+}
+
+std::vector<py::ssize_t> PyFrame::strides() const
+{
+    if (image_.channels() == 1) {
+        return { image_.stride_, 1 };
+    }
+    return { image_.stride_, image_.channels(), 1 };
+}
+
+// Context of an exported tensor, owns a reference to the pixels.
+struct DLPackFrame {
+    rtspcam::Image image_;
+    int64_t shape_[3];
+    int64_t strides_[3];
+    DLManagedTensor tensor_;
+};
+
+// The unversioned DLManagedTensor has no read-only flag. Consumers get the frame's own pixels,
+// which may be the decoder's reference frame (see `Image::is_shared_`), and must not write them.
+static py::capsule frame_to_dlpack(PyFrame const& frame, py::object /*stream*/)
+{
+    auto shape = frame.shape();
+    auto strides = frame.strides();
+
+    auto* ctx = new DLPackFrame { frame.image_, {}, {}, {} };
+    for (size_t i = 0; i < shape.size(); i++) {
+        ctx->shape_[i] = shape[i];
+        ctx->strides_[i] = strides[i];
+    }
+
+    auto& tensor = ctx->tensor_;
+    tensor.dl_tensor.data = ctx->image_.data_;
+    tensor.dl_tensor.device = { dl_device_cpu, 0 };
+    tensor.dl_tensor.ndim = (int32_t)shape.size();
+    tensor.dl_tensor.dtype = { dl_type_uint, 8, 1 };
+    tensor.dl_tensor.shape = ctx->shape_;
+    tensor.dl_tensor.strides = ctx->strides_;
+    tensor.dl_tensor.byte_offset = 0;
+    tensor.manager_ctx = ctx;
+    tensor.deleter = [](DLManagedTensor* self) { delete static_cast<DLPackFrame*>(self->manager_ctx); };
+
+    // a consumer renames the capsule to "used_dltensor" and takes over the deleter
+    auto* capsule = PyCapsule_New(&tensor, "dltensor", [](PyObject* capsule) {
+        if (PyCapsule_IsValid(capsule, "dltensor")) {
+            auto* tensor = static_cast<DLManagedTensor*>(PyCapsule_GetPointer(capsule, "dltensor"));
+            tensor->deleter(tensor);
+        }
+    });
+    if (capsule == nullptr) {
+        delete ctx;
+        throw py::error_already_set();
+    }
+
+    return py::reinterpret_steal<py::capsule>(capsule);
+}
+
+size_t PyCameraSet::add(PyCam& camera)
+{
+    return handle_.add(camera.camera());
+}
+
+std::vector<size_t> PyCameraSet::wait(std::optional<int> timeout_ms)
+{
+    std::optional<std::chrono::milliseconds> timeout;
+    if (timeout_ms) {
+        timeout = std::chrono::milliseconds(timeout_ms.value());
+    }
+
+    py::gil_scoped_release release;
+    return handle_.wait(timeout);
+}
+
+int PyCameraSet::fd() const
+{
+    return handle_.fd();
+}
+
+py::tuple PyCameraSet::read_batch(int width, int height, rtspcam::ImageFormat format)
+{
+    rtspcam::OutputSpec spec(width, height, format);
+    py::ssize_t count = handle_.size();
+    py::ssize_t channels = format == rtspcam::ImageFormat::GRAY ? 1 : 3;
+
+    // slots are converted straight into the array, there is no stacking copy
+    py::array_t<uint8_t> images({ count, (py::ssize_t)height, (py::ssize_t)width, channels });
+    void* data = images.mutable_data();
+    rtspcam::Batch batch;
+    {
+        py::gil_scoped_release release;
+        batch = handle_.read_batch(data, handle_.batch_size(spec), spec);
+    }
+
+    py::array_t<uint64_t> frame_indices(count, batch.frame_indices_.data());
+    py::array_t<int64_t> timestamps(count, batch.timestamps_.data());
+    py::array_t<bool> stale(count, reinterpret_cast<bool const*>(batch.stale_.data()));
+    py::array_t<bool> missing(count, reinterpret_cast<bool const*>(batch.missing_.data()));
+
+    return py::make_tuple(images, frame_indices, timestamps, stale, missing);
+}
+
+#ifndef _WIN32
+// Returns the frame's pixels as a read-only view into the reader's mapping, which `reader` keeps
+// alive. The view is only meaningful while `ShmRingReader.is_intact` holds.
+static py::object to_shm_frame(std::optional<rtspcam::ShmFrame> const& frame, py::object reader)
+{
+    if (!frame) {
+        return py::none();
+    }
+
+    py::ssize_t height = frame->height_;
+    py::ssize_t width = frame->width_;
+    py::ssize_t stride = frame->stride_;
+    py::ssize_t channels = frame->format_ == rtspcam::ImageFormat::GRAY ? 1 : 3;
+
+    // gray frames are 2-D, like the arrays `read` returns
+    py::array_t<uint8_t> image;
+    if (channels == 1) {
+        image = py::array_t<uint8_t>({ height, width }, { stride, (py::ssize_t)1 }, frame->data_, reader);
+    } else {
+        image = py::array_t<uint8_t>({ height, width, channels }, { stride, channels, (py::ssize_t)1 },
+            frame->data_, reader);
+    }
+    // the mapping is read-only
+    image.attr("setflags")(py::arg("write") = false);
+
+    py::dict result;
+    result["image"] = image;
+    result["sequence"] = frame->sequence_;
+    result["frame_index"] = frame->frame_index_;
+    result["timestamp"] = frame->timestamp_;
+    return std::move(result);
+}
+
+static bool shm_is_intact(rtspcam::ShmRingReader const& reader, py::dict const& frame)
+{
+    rtspcam::ShmFrame shm_frame {};
+    shm_frame.sequence_ = frame["sequence"].cast<uint64_t>();
+    return reader.is_intact(shm_frame);
+}
+#endif
+
+static PyCam pycam_open(std::string const& url, bool prefetch)
+{
+    PyCam camera(url);
+    camera.set_prefetch(prefetch);
+    return camera;
+}
+
+static std::vector<PyCam> pycam_open_all(std::vector<std::string> const& urls, size_t max_handshakes)
+{
+    rtspcam::OpenOptions options;
+    options.max_handshakes_ = max_handshakes;
+
+    std::vector<std::unique_ptr<rtspcam::RtspCamera>> handles;
+    {
+        py::gil_scoped_release release;
+        handles = rtspcam::RtspCamera::open_all(urls, options);
+    }
+
+    std::vector<PyCam> cameras;
+    cameras.reserve(handles.size());
+    for (auto& handle : handles) {
+        cameras.emplace_back(std::move(handle));
+    }
+    return cameras;
 }
 
 PYBIND11_MODULE(pycam, m)
 {
+    py::enum_<rtspcam::ImageFormat>(m, "ImageFormat")
+        .value("RGB", rtspcam::ImageFormat::RGB)
+        .value("BGR", rtspcam::ImageFormat::BGR)
+        .value("GRAY", rtspcam::ImageFormat::GRAY);
+
+    py::class_<rtspcam::Rect>(m, "Rect")
+        .def(py::init<int, int, int, int>(), py::arg("x"), py::arg("y"), py::arg("width"),
+            py::arg("height"))
+        .def_readwrite("x", &rtspcam::Rect::x_)
+        .def_readwrite("y", &rtspcam::Rect::y_)
+        .def_readwrite("width", &rtspcam::Rect::width_)
+        .def_readwrite("height", &rtspcam::Rect::height_);
+
+    py::class_<rtspcam::OutputSpec>(m, "OutputSpec")
+        .def(py::init<int, int, rtspcam::ImageFormat, std::optional<rtspcam::Rect>>(),
+            py::arg("width") = 0, py::arg("height") = 0,
+            py::arg("format") = rtspcam::ImageFormat::RGB, py::arg("roi") = py::none())
+        .def_readwrite("width", &rtspcam::OutputSpec::width_)
+        .def_readwrite("height", &rtspcam::OutputSpec::height_)
+        .def_readwrite("format", &rtspcam::OutputSpec::format_)
+        .def_readwrite("roi", &rtspcam::OutputSpec::roi_);
+
+    py::enum_<rtspcam::TensorLayout>(m, "TensorLayout")
+        .value("NCHW", rtspcam::TensorLayout::NCHW)
+        .value("NHWC", rtspcam::TensorLayout::NHWC);
+
+    py::enum_<rtspcam::TensorType>(m, "TensorType")
+        .value("FLOAT32", rtspcam::TensorType::FLOAT32)
+        .value("FLOAT16", rtspcam::TensorType::FLOAT16);
+
+    py::class_<rtspcam::TensorFormat>(m, "TensorFormat")
+        .def(py::init<rtspcam::TensorLayout, rtspcam::TensorType, std::array<float, 3>,
+                 std::array<float, 3>>(),
+            py::arg("layout") = rtspcam::TensorLayout::NCHW,
+            py::arg("type") = rtspcam::TensorType::FLOAT32,
+            py::arg("mean") = std::array<float, 3> { 0.0f, 0.0f, 0.0f },
+            py::arg("std") = std::array<float, 3> { 1.0f, 1.0f, 1.0f });
+
+    py::enum_<rtspcam::DeliveryMode>(m, "DeliveryMode")
+        .value("LATEST", rtspcam::DeliveryMode::LATEST)
+        .value("QUEUE", rtspcam::DeliveryMode::QUEUE);
+
+    py::class_<rtspcam::Delivery>(m, "Delivery")
+        .def(py::init<rtspcam::DeliveryMode, size_t, bool>(),
+            py::arg("mode") = rtspcam::DeliveryMode::LATEST, py::arg("queue_size") = 1,
+            py::arg("block") = false)
+        .def_readwrite("mode", &rtspcam::Delivery::mode_)
+        .def_readwrite("queue_size", &rtspcam::Delivery::queue_size_)
+        .def_readwrite("block", &rtspcam::Delivery::block_);
+
+    py::enum_<rtspcam::QualityTier>(m, "QualityTier")
+        .value("FULL", rtspcam::QualityTier::FULL)
+        .value("NO_LOOP_FILTER", rtspcam::QualityTier::NO_LOOP_FILTER)
+        .value("DROP_NONREF", rtspcam::QualityTier::DROP_NONREF)
+        .value("KEYFRAMES_ONLY", rtspcam::QualityTier::KEYFRAMES_ONLY);
+
+    py::enum_<rtspcam::LossPolicy>(m, "LossPolicy")
+        .value("CONCEAL", rtspcam::LossPolicy::CONCEAL)
+        .value("SKIP_TO_KEYFRAME", rtspcam::LossPolicy::SKIP_TO_KEYFRAME);
+
+    py::class_<rtspcam::StartupTimes>(m, "StartupTimes")
+        .def_readonly("described_us", &rtspcam::StartupTimes::described_)
+        .def_readonly("playing_us", &rtspcam::StartupTimes::playing_)
+        .def_readonly("first_packet_us", &rtspcam::StartupTimes::first_packet_)
+        .def_readonly("first_keyframe_us", &rtspcam::StartupTimes::first_keyframe_)
+        .def_readonly("first_frame_us", &rtspcam::StartupTimes::first_frame_)
+        .def_readonly("first_read_us", &rtspcam::StartupTimes::first_read_);
+
+    py::class_<rtspcam::CameraStats>(m, "CameraStats")
+        .def_readonly("frames_decoded", &rtspcam::CameraStats::frames_decoded_)
+        .def_readonly("frames_delivered", &rtspcam::CameraStats::frames_delivered_)
+        .def_readonly("frames_skipped", &rtspcam::CameraStats::frames_skipped_)
+        .def_readonly("frames_decimated", &rtspcam::CameraStats::frames_decimated_)
+        .def_readonly("packets_decoded", &rtspcam::CameraStats::packets_decoded_)
+        .def_readonly("units_discarded", &rtspcam::CameraStats::units_discarded_)
+        .def_readonly("quality_tier", &rtspcam::CameraStats::quality_tier_)
+        .def_readonly("tier_changes", &rtspcam::CameraStats::tier_changes_)
+        .def_readonly("decode_queue_depth", &rtspcam::CameraStats::decode_queue_depth_)
+        .def_readonly("is_suspended", &rtspcam::CameraStats::is_suspended_)
+        .def_readonly("suspends", &rtspcam::CameraStats::suspends_)
+        .def_readonly("resume_latency_us", &rtspcam::CameraStats::resume_latency_)
+        .def_readonly("startup", &rtspcam::CameraStats::startup_)
+        .def_readonly("packets_lost", &rtspcam::CameraStats::packets_lost_)
+        .def_readonly("keyframe_requests", &rtspcam::CameraStats::keyframe_requests_)
+        .def_readonly("keyframe_recovery_us", &rtspcam::CameraStats::keyframe_recovery_)
+        .def_readonly("is_reconnecting", &rtspcam::CameraStats::is_reconnecting_)
+        .def_readonly("reconnects", &rtspcam::CameraStats::reconnects_)
+        .def_readonly("reconnect_attempts", &rtspcam::CameraStats::reconnect_attempts_)
+        .def_readonly("gaps", &rtspcam::CameraStats::gaps_)
+        .def_readonly("frames_concealed", &rtspcam::CameraStats::frames_concealed_)
+        .def_readonly("decode_errors", &rtspcam::CameraStats::decode_errors_)
+        .def_readonly("callback_errors", &rtspcam::CameraStats::callback_errors_);
+
+    py::class_<rtspcam::ReconnectPolicy>(m, "ReconnectPolicy")
+        .def(py::init<>())
+        .def_property("initial_delay_ms",
+            [](rtspcam::ReconnectPolicy const& policy) { return (int)policy.initial_delay_.count(); },
+            [](rtspcam::ReconnectPolicy& policy, int delay_ms) {
+                policy.initial_delay_ = std::chrono::milliseconds(delay_ms);
+            })
+        .def_property("max_delay_ms",
+            [](rtspcam::ReconnectPolicy const& policy) { return (int)policy.max_delay_.count(); },
+            [](rtspcam::ReconnectPolicy& policy, int delay_ms) {
+                policy.max_delay_ = std::chrono::milliseconds(delay_ms);
+            })
+        .def_readwrite("max_attempts", &rtspcam::ReconnectPolicy::max_attempts_)
+        .def_property("stall_timeout_ms",
+            [](rtspcam::ReconnectPolicy const& policy) { return (int)policy.stall_timeout_.count(); },
+            [](rtspcam::ReconnectPolicy& policy, int timeout_ms) {
+                policy.stall_timeout_ = std::chrono::milliseconds(timeout_ms);
+            });
+
+    py::class_<rtspcam::GovernorConfig>(m, "GovernorConfig")
+        .def(py::init<>())
+        .def_property("interval_ms",
+            [](rtspcam::GovernorConfig const& config) { return (int)config.interval_.count(); },
+            [](rtspcam::GovernorConfig& config, int interval_ms) {
+                config.interval_ = std::chrono::milliseconds(interval_ms);
+            })
+        .def_readwrite("max_queue_depth", &rtspcam::GovernorConfig::max_queue_depth_)
+        .def_readwrite("max_load", &rtspcam::GovernorConfig::max_load_)
+        .def_readwrite("recover_load", &rtspcam::GovernorConfig::recover_load_)
+        .def_readwrite("recover_intervals", &rtspcam::GovernorConfig::recover_intervals_);
+
+    py::class_<PyFrame>(m, "Frame", py::buffer_protocol())
+        .def_buffer([](PyFrame& frame) {
+            // shared pixels are read-only, as with `numpy`
+            return py::buffer_info(frame.image_.data_, sizeof(uint8_t),
+                py::format_descriptor<uint8_t>::format(), (py::ssize_t)frame.shape().size(),
+                frame.shape(), frame.strides(), frame.image_.is_shared_);
+        })
+        .def("__dlpack__", &frame_to_dlpack,
+            "Export the pixels without a copy, the consumer must not write to them", py::arg("stream") = py::none())
+        .def("__dlpack_device__", [](PyFrame const&) { return py::make_tuple(dl_device_cpu, 0); })
+        .def("numpy", [](PyFrame const& frame) { return to_array(frame.image_); },
+            "Image as a numpy array, no copy")
+        .def_property_readonly("frame_index", [](PyFrame const& frame) { return frame.image_.frame_index_; })
+        .def_property_readonly("timestamp", [](PyFrame const& frame) { return frame.image_.timestamp_; })
+        .def_property_readonly("skipped", [](PyFrame const& frame) { return frame.image_.skipped_; })
+        .def_property_readonly("is_corrupt", [](PyFrame const& frame) { return frame.image_.is_corrupt_; })
+        .def_property_readonly("width", [](PyFrame const& frame) { return frame.image_.width_; })
+        .def_property_readonly("height", [](PyFrame const& frame) { return frame.image_.height_; })
+        .def_property_readonly("format", [](PyFrame const& frame) { return frame.image_.format_; });
+
     py::class_<PyCam>(m, "PyCam")
         //.def(py::init<const std::string &>())
         //.def("read", &PyCam::read, "read", py::return_value_policy::reference_internal);
-        .def("read", &PyCam::read, "Read image from camera");
+        .def("read", &PyCam::read, "Read image from camera, read-only if it is the decoder's own luma plane")
+        .def("read_frame", &PyCam::read_frame, "Read image from camera together with its metadata")
+        .def("read_async", &pycam_read_async,
+            "Return an asyncio future of the next image, waits on the running loop without threads")
+        .def("read_raw", &PyCam::read_raw,
+            "Read decoded frame as is, returns a dict of planes (views) and metadata")
+        .def("fileno", &PyCam::fileno, "File descriptor that becomes readable when an image may be ready, don't use with a CameraSet")
+        .def("is_ready", &PyCam::is_ready, "Whether read would return without waiting for the stream")
+        .def("stats", &PyCam::stats, "Counters of this reader and its stream")
+        .def("wait_started", &PyCam::wait_started,
+            "Wait for the first frame, False on timeout (seconds), raises if the stream failed first",
+            py::arg("timeout") = py::none())
+        .def("set_size", &PyCam::set_size, "Set size of images returned by read, 0x0 keeps the stream's")
+        .def("set_conversion_threads", &PyCam::set_conversion_threads,
+            "Split conversion of every image across threads, 0 uses one per core")
+        .def("subscribe", &PyCam::subscribe, "Open another reader sharing this camera's stream",
+            py::arg("delivery") = rtspcam::Delivery())
+        .def("skipped_frames", &PyCam::skipped_frames, "Number of frames this reader never got")
+        .def("set_delivery", &PyCam::set_delivery, "Select latest-only or queued delivery of frames")
+        .def("set_max_rate", &PyCam::set_max_rate,
+            "Limit this reader to fps frames per second, frames that aren't due are never converted",
+            py::arg("fps"), py::arg("drop_nonref") = false)
+        .def("set_keyframes_only", &PyCam::set_keyframes_only,
+            "Decode keyframes only, about one image per GOP")
+        .def("set_priority", &PyCam::set_priority,
+            "Order of the stream for the governor, lower priorities are degraded first")
+        .def("set_idle_timeout", &PyCam::set_idle_timeout,
+            "Pause the stream after this many seconds without reads, 0 keeps it playing")
+        .def("set_error_budget", &PyCam::set_error_budget, py::arg("errors"),
+            "Number of decode errors in a row tolerated before the camera fails, 0 for no limit")
+        .def("set_loss_policy", &PyCam::set_loss_policy,
+            "Decode frames after packet loss marked corrupt, or skip them until the next keyframe")
+        .def("set_reconnect", &PyCam::set_reconnect,
+            "Reconnect a failed stream with backoff instead of raising, None disables it",
+            py::arg("policy") = rtspcam::ReconnectPolicy())
+        .def("set_prefetch", &PyCam::set_prefetch,
+            "Keep the next image converted in the background, set before the first read")
+        .def("read_tensor", &PyCam::read_tensor, "Read image from camera as a normalized tensor")
+        .def("read_outputs", &PyCam::read_outputs,
+            "Read all named outputs from camera, outputs sharing a conversion are read-only")
+        .def("set_image_format", &PyCam::set_image_format, "Set format of images returned by read")
+        .def("set_roi", &PyCam::set_roi, "Crop images returned by read, None disables cropping")
+        .def("add_output", &PyCam::add_output, "Add or replace a named output")
+        .def("remove_output", &PyCam::remove_output, "Remove a named output")
+        .def("set_output_roi", &PyCam::set_output_roi, "Move the region of interest of a named output");
+
+    py::class_<PyCameraSet>(m, "CameraSet")
+        .def(py::init<>())
+        .def("add", &PyCameraSet::add, "Add camera to the set and return its index",
+            py::keep_alive<1, 2>())
+        .def("wait", &PyCameraSet::wait,
+            "Wait until any camera has a new image and return indices of ready cameras",
+            py::arg("timeout_ms") = py::none())
+        .def("fd", &PyCameraSet::fd, "File descriptor that becomes readable when a camera may be ready")
+        .def("read_batch", &PyCameraSet::read_batch,
+            "Read newest image of every camera as one (N, H, W, C) array, returns "
+            "(images, frame_indices, timestamps, stale, missing)",
+            py::arg("width"), py::arg("height"), py::arg("format") = rtspcam::ImageFormat::BGR);
+
+#ifndef _WIN32
+    py::class_<rtspcam::ShmRingReader>(m, "ShmRingReader")
+        .def(py::init<std::string const&>(), py::arg("name"))
+        .def(
+            "latest",
+            [](py::object self) {
+                return to_shm_frame(self.cast<rtspcam::ShmRingReader const&>().latest(), self);
+            },
+            "Newest frame as a dict of image (read-only view), sequence, frame_index and timestamp")
+        .def(
+            "wait",
+            [](py::object self, std::optional<uint64_t> sequence, int timeout_ms) {
+                auto const& reader = self.cast<rtspcam::ShmRingReader const&>();
+                std::optional<rtspcam::ShmFrame> frame;
+                {
+                    py::gil_scoped_release release;
+                    frame = reader.wait(sequence, std::chrono::milliseconds(timeout_ms));
+                }
+                return to_shm_frame(frame, self);
+            },
+            "Wait for a frame newer than sequence, None on timeout", py::arg("sequence") = py::none(),
+            py::arg("timeout_ms") = 1000)
+        .def("is_intact", &shm_is_intact, "Whether the frame's pixels were not overwritten yet");
+#endif
 
-    m.def("open", &pycam_open, "Open camera stream");
+    m.def("open", &pycam_open, "Open camera stream", py::arg("url"), py::arg("prefetch") = false);
+    m.def("open_all", &pycam_open_all,
+        "Open camera streams without waiting for them, with a bounded number of handshakes at a time",
+        py::arg("urls"), py::arg("max_handshakes") = rtspcam::OpenOptions().max_handshakes_);
+    m.def(
+        "enable_governor",
+        [](rtspcam::GovernorConfig const& config) { rtspcam::Governor::instance().enable(config); },
+        "Lower decoding quality of streams while the host is overloaded",
+        py::arg("config") = rtspcam::GovernorConfig());
+    m.def(
+        "disable_governor",
+        []() {
+            py::gil_scoped_release release;
+            rtspcam::Governor::instance().disable();
+        },
+        "Stop the governor and restore full quality");
 }
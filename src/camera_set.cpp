@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "camera_set.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+using namespace rtspcam;
+
+// Shared by the set and the ready callbacks of its cameras, which may still be running while the
+// set goes away.
+struct CameraSet::Wakeup {
+    Wakeup()
+        : generation_(0)
+        , fd_(-1)
+    {
+#ifdef __linux__
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_ < 0) {
+            throw std::runtime_error("Failed to create eventfd");
+        }
+#endif
+    }
+
+    ~Wakeup()
+    {
+#ifdef __linux__
+        close(fd_);
+#endif
+    }
+
+    void signal()
+    {
+        {
+            std::scoped_lock lock(mutex_);
+            generation_ += 1;
+        }
+        condvar_.notify_all();
+
+#ifdef __linux__
+        uint64_t value = 1;
+        [[maybe_unused]] auto ret = write(fd_, &value, sizeof(value));
+#endif
+    }
+
+    void drain()
+    {
+#ifdef __linux__
+        uint64_t value;
+        [[maybe_unused]] auto ret = read(fd_, &value, sizeof(value));
+#endif
+    }
+
+    std::mutex mutex_;
+    std::condition_variable condvar_;
+    uint64_t generation_;
+    int fd_;
+};
+
+// Runs the slots of a batch on one thread per core. The calling thread takes part, so a batch of
+// a single camera never hands work over. Slots are claimed under the lock, a batch is a handful
+// of conversions that each take milliseconds.
+class CameraSet::Workers {
+public:
+    Workers()
+        : job_(nullptr)
+        , generation_(0)
+        , count_(0)
+        , next_(0)
+        , pending_(0)
+        , quit_(false)
+    {
+        auto num_threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        for (unsigned i = 0; i < num_threads; i++) {
+            threads_.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~Workers()
+    {
+        {
+            std::scoped_lock lock(mutex_);
+            quit_ = true;
+        }
+        start_condvar_.notify_all();
+
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Calls `job` for every index in [0, count) and returns once all calls are done.
+    void run(size_t count, std::function<void(size_t)> const& job)
+    {
+        uint64_t generation = 0;
+        {
+            std::scoped_lock lock(mutex_);
+            job_ = &job;
+            count_ = count;
+            next_ = 0;
+            pending_ = count;
+            generation_ += 1;
+            generation = generation_;
+        }
+        start_condvar_.notify_all();
+
+        work(generation);
+
+        std::unique_lock lock(mutex_);
+        done_condvar_.wait(lock, [this]() { return pending_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    void worker_loop()
+    {
+        uint64_t generation = 0;
+        while (true) {
+            {
+                std::unique_lock lock(mutex_);
+                start_condvar_.wait(lock, [&]() { return quit_ || generation_ != generation; });
+                if (quit_) {
+                    return;
+                }
+                generation = generation_;
+            }
+
+            work(generation);
+        }
+    }
+
+    void work(uint64_t generation)
+    {
+        std::unique_lock lock(mutex_);
+        // a worker waking up late must not pick up slots of a later batch with an old job
+        while (generation_ == generation && next_ < count_) {
+            auto index = next_++;
+            auto const* job = job_;
+
+            lock.unlock();
+            (*job)(index);
+            lock.lock();
+
+            pending_ -= 1;
+            if (pending_ == 0) {
+                done_condvar_.notify_all();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable start_condvar_;
+    std::condition_variable done_condvar_;
+    std::function<void(size_t)> const* job_;
+    uint64_t generation_;
+    size_t count_;
+    size_t next_;
+    size_t pending_;
+    bool quit_;
+    std::vector<std::thread> threads_;
+};
+
+CameraSet::CameraSet()
+    : wakeup_(std::make_shared<Wakeup>())
+{
+}
+
+CameraSet::~CameraSet()
+{
+    for (auto* camera : cameras_) {
+        camera->set_ready_callback({});
+    }
+}
+
+size_t CameraSet::add(RtspCamera& camera)
+{
+    camera.set_ready_callback([wakeup = wakeup_]() { wakeup->signal(); });
+    cameras_.push_back(&camera);
+    return cameras_.size() - 1;
+}
+
+RtspCamera& CameraSet::camera(size_t index) const
+{
+    return *cameras_.at(index);
+}
+
+size_t CameraSet::size() const
+{
+    return cameras_.size();
+}
+
+std::vector<size_t> CameraSet::wait(std::optional<std::chrono::milliseconds> timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout.value_or(std::chrono::milliseconds(0));
+    std::vector<size_t> ready;
+
+    while (true) {
+        uint64_t generation = 0;
+        {
+            std::scoped_lock lock(wakeup_->mutex_);
+            generation = wakeup_->generation_;
+        }
+
+        // drained before scanning, so a camera turning ready during the scan leaves the fd readable
+        wakeup_->drain();
+
+        for (size_t i = 0; i < cameras_.size(); i++) {
+            if (cameras_[i]->is_ready()) {
+                ready.push_back(i);
+            }
+        }
+
+        if (!ready.empty()) {
+            return ready;
+        }
+
+        std::unique_lock lock(wakeup_->mutex_);
+        auto is_signaled = [this, generation]() { return wakeup_->generation_ != generation; };
+        if (!timeout) {
+            wakeup_->condvar_.wait(lock, is_signaled);
+        } else if (!wakeup_->condvar_.wait_until(lock, deadline, is_signaled)) {
+            return ready;
+        }
+    }
+}
+
+int CameraSet::fd() const
+{
+    return wakeup_->fd_;
+}
+
+size_t CameraSet::batch_size(OutputSpec const& spec) const
+{
+    int channels = spec.format_ == ImageFormat::GRAY ? 1 : 3;
+    return cameras_.size() * spec.height_ * spec.width_ * channels;
+}
+
+Batch CameraSet::read_batch(void* buffer, size_t size, OutputSpec const& spec)
+{
+    if (spec.width_ <= 0 || spec.height_ <= 0) {
+        throw std::runtime_error("Batched images need a fixed size");
+    }
+    if (batch_size(spec) > size) {
+        throw std::runtime_error("Batch buffer too small");
+    }
+
+    if (!workers_) {
+        workers_ = std::make_unique<Workers>();
+    }
+
+    auto const count = cameras_.size();
+    int const stride = spec.width_ * (spec.format_ == ImageFormat::GRAY ? 1 : 3);
+    size_t const slot_size = (size_t)stride * spec.height_;
+    auto* data = static_cast<uint8_t*>(buffer);
+
+    Batch batch;
+    batch.frame_indices_.resize(count, 0);
+    batch.timestamps_.resize(count, -1);
+    batch.stale_.resize(count, 1);
+    batch.missing_.resize(count, 1);
+
+    // every job writes its own slot and its own entries of `batch`, no locking needed
+    workers_->run(count, [&](size_t i) {
+        auto* slot_data = data + i * slot_size;
+        try {
+            auto slot = cameras_[i]->read_into(slot_data, stride, spec);
+            batch.frame_indices_[i] = slot.frame_index_;
+            batch.timestamps_[i] = slot.timestamp_;
+            batch.stale_[i] = slot.is_stale_ ? 1 : 0;
+            batch.missing_[i] = slot.is_missing_ ? 1 : 0;
+        } catch (std::exception const&) {
+            // one bad camera must not fail the whole batch
+            std::memset(slot_data, 0, slot_size);
+        }
+    });
+
+    return batch;
+}
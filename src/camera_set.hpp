@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "rtsp_camera.hpp"
+
+namespace rtspcam {
+
+// Per-camera results of `CameraSet::read_batch`, indexed like the cameras of the set.
+struct Batch {
+    std::vector<uint64_t> frame_indices_;
+    // Presentation times in microseconds since the epoch, -1 if unknown.
+    std::vector<int64_t> timestamps_;
+    // The camera had no new frame, its slot holds the previous one again.
+    std::vector<uint8_t> stale_;
+    // The camera had no frame at all or failed, its slot is zeroed.
+    std::vector<uint8_t> missing_;
+};
+
+// Waits on many cameras from a single thread. Cameras signal a shared wakeup when they push a
+// frame, so a waiting thread costs nothing until one of them becomes ready.
+//
+// A camera can belong to at most one set, and must outlive it.
+class CameraSet {
+public:
+    CameraSet();
+    ~CameraSet();
+
+    CameraSet(CameraSet const&) = delete;
+    CameraSet& operator=(CameraSet const&) = delete;
+
+    // Adds `camera` to the set and returns its index.
+    size_t add(RtspCamera& camera);
+    RtspCamera& camera(size_t index) const;
+    size_t size() const;
+
+    // Returns indices of cameras that have a new image (or an error) to `read`. Waits for at most
+    // `timeout`, or without limit if none is given, and returns an empty list if it expires.
+    std::vector<size_t> wait(std::optional<std::chrono::milliseconds> timeout = {});
+
+    // Returns a file descriptor that becomes readable when a camera may have become ready, for use
+    // with poll/epoll. Call `wait` with a zero timeout to collect the ready cameras, which also
+    // rearms it. Returns -1 where eventfd is not available.
+    int fd() const;
+
+    // Returns number of bytes of a batch of `spec` images, laid out as (N, H, W, C).
+    size_t batch_size(OutputSpec const& spec) const;
+    // Converts the newest frame of every camera straight into its slot of `buffer`, in parallel
+    // across cores. Never waits for frames, see `Batch` for how slots without one are filled.
+    // `spec` must have a fixed size.
+    Batch read_batch(void* buffer, size_t size, OutputSpec const& spec);
+
+private:
+    struct Wakeup;
+    class Workers;
+
+    std::vector<RtspCamera*> cameras_;
+    std::shared_ptr<Wakeup> wakeup_;
+    std::unique_ptr<Workers> workers_;
+};
+
+} // namespace rtspcam
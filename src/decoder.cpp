@@ -8,8 +8,10 @@
 #include "video_frame.hpp"
 
 #include <cassert>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <thread>
 
 extern "C" {
@@ -21,15 +23,39 @@ using namespace rtspcam;
 
 static constexpr bool be_verbose = false;
 
-Decoder::Decoder(Swapper<VideoFramePtr>& swapper, Slice extradata)
+Decoder::Decoder(FrameChannel& channel,
+    DecoderControl& control,
+    ErrorSlot& error_slot,
+    VideoCodec codec,
+    Slice extradata)
     : src_frame_(make_videoframe())
     , packet_(av_packet_alloc(), AVPacketDeleter())
-    , swapper_(swapper)
+    , codec_(codec)
+    , extradata_(extradata.data_, extradata.data_ + extradata.size_)
+    , channel_(channel)
+    , control_(control)
+    , error_slot_(error_slot)
     , first_frame_(true)
+    , awaiting_keyframe_(false)
+    , consecutive_errors_(0)
+    , is_failed_(false)
 {
-    AVCodec const* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+}
+
+Decoder::~Decoder()
+{
+    if (thread_.joinable()) {
+        queue_.push({ {}, AV_NOPTS_VALUE });
+        thread_.join();
+    }
+}
+
+void Decoder::open()
+{
+    AVCodecID codec_id = codec_ == VideoCodec::H265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+    AVCodec const* codec = avcodec_find_decoder(codec_id);
     if (!codec) {
-        throw std::runtime_error("codec h264 not found");
+        throw std::runtime_error(std::string("codec ") + avcodec_get_name(codec_id) + " not found");
     }
 
     parser_context_ = std::unique_ptr<AVCodecParserContext, AVCodecParserContextDeleter>(
@@ -44,14 +70,18 @@ Decoder::Decoder(Swapper<VideoFramePtr>& swapper, Slice extradata)
         throw std::runtime_error("failed to allocate codec context");
     }
 
-    if (extradata.size_ != 0) {
+    if (!extradata_.empty()) {
         if constexpr (be_verbose) {
             std::cout << "setting decoder extradata" << std::endl;
         }
-        codec_context_->extradata = (uint8_t*)av_mallocz(extradata.size_ + AV_INPUT_BUFFER_PADDING_SIZE);
+        codec_context_->extradata = (uint8_t*)av_mallocz(extradata_.size() + AV_INPUT_BUFFER_PADDING_SIZE);
         assert(codec_context_->extradata);
-        std::copy(extradata.data_, extradata.data_ + extradata.size_, codec_context_->extradata);
-        codec_context_->extradata_size = (int)extradata.size_;
+        std::copy(extradata_.begin(), extradata_.end(), codec_context_->extradata);
+        codec_context_->extradata_size = (int)extradata_.size();
+    }
+
+    if (control_.gray_.load(std::memory_order_relaxed)) {
+        codec_context_->flags |= AV_CODEC_FLAG_GRAY;
     }
 
     // AVDictionary* options = nullptr;
@@ -60,20 +90,34 @@ Decoder::Decoder(Swapper<VideoFramePtr>& swapper, Slice extradata)
     if (avcodec_open2(codec_context_.get(), codec, /*&options*/ nullptr) != 0) {
         throw std::runtime_error("failed to open codec");
     }
+}
+
+void Decoder::send(Slice slice, int64_t pts, bool is_damaged)
+{
+    // the codec is opened on the decoder thread, a stream that never sends costs nothing
+    if (!thread_.joinable()) {
+        thread_ = std::thread([this]() {
+            try {
+                open();
+            } catch (std::runtime_error const& e) {
+                fail(e.what());
+            }
+            decode_loop();
+        });
+    }
 
-    thread_ = std::thread([this]() { decode_loop(); });
+    // FIXME(bostjan): Avoid allocation by using memory pool
+    queue_.push({ { slice.data_, slice.data_ + slice.size_ }, pts, false, false, is_damaged });
 }
 
-Decoder::~Decoder()
+void Decoder::flush()
 {
-    queue_.push({});
-    thread_.join();
+    queue_.push({ {}, AV_NOPTS_VALUE, true, true });
 }
 
-void Decoder::send(Slice slice, uint64_t /*pts*/)
+void Decoder::restart()
 {
-    // FIXME(bostjan): Avoid allocation by using memory pool
-    queue_.push({ slice.data_, slice.data_ + slice.size_ });
+    queue_.push({ {}, AV_NOPTS_VALUE, true, false });
 }
 
 void Decoder::decode()
@@ -83,23 +127,38 @@ void Decoder::decode()
     auto* codec_context = codec_context_.get();
     auto* packet = packet_.get();
 
+    // takes effect from this packet on, reference frames keep decoding either way
+    codec_context->skip_frame = control_.drop_nonref() ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    codec_context->skip_loop_filter = control_.skip_loop_filter() ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+
+    auto start = std::chrono::steady_clock::now();
     ret = avcodec_send_packet(codec_context, packet);
     if (ret != 0) {
-        throw std::runtime_error("Error sending a packet for decoding");
+        on_error("error sending a packet for decoding", ret);
+        return;
     }
+    control_.packets_decoded_.fetch_add(1, std::memory_order_relaxed);
 
     while (ret >= 0) {
         auto* src_frame = src_frame_.get();
 
         ret = avcodec_receive_frame(codec_context, src_frame);
+        // publishing may run reader callbacks, which don't count as decoding
+        auto end = std::chrono::steady_clock::now();
+        control_.decode_time_.fetch_add(
+            (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+            std::memory_order_relaxed);
+
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             return;
         }
         if (ret < 0) {
-            throw std::runtime_error("Error during decoding");
+            on_error("error during decoding", ret);
+            return;
         }
 
         assert(ret == 0);
+        consecutive_errors_ = 0;
 
         if (first_frame_) {
             first_frame_ = false;
@@ -122,20 +181,110 @@ void Decoder::decode()
             assert(src_frame->format == codec_context_->pix_fmt);
         }
 
-        src_frame_ = swapper_.push(std::move(src_frame_));
+        if ((src_frame->flags & AV_FRAME_FLAG_CORRUPT) != 0 || src_frame->decode_error_flags != 0) {
+            control_.keyframe_wanted_.store(true, std::memory_order_relaxed);
+        }
+
+        // frames come out in presentation order, older damaged ones were discarded by the codec
+        if (src_frame->pts != AV_NOPTS_VALUE && !damaged_pts_.empty()) {
+            if (damaged_pts_.count(src_frame->pts) != 0) {
+                src_frame->flags |= AV_FRAME_FLAG_CORRUPT;
+            }
+            damaged_pts_.erase(damaged_pts_.begin(), damaged_pts_.upper_bound(src_frame->pts));
+        }
+        if ((src_frame->flags & AV_FRAME_FLAG_CORRUPT) != 0) {
+            control_.frames_concealed_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // subscribers take references, the next receive_frame() unreferences `src_frame_`
+        channel_.publish(src_frame_.get());
+        start = std::chrono::steady_clock::now();
+
+        DecoderControl::mark(control_.first_frame_);
+        // first frame since the stream was asked to resume
+        if (control_.resume_started_.load(std::memory_order_relaxed) != 0) {
+            int64_t resume_started = control_.resume_started_.exchange(0, std::memory_order_relaxed);
+            control_.resume_latency_.store(steady_time_us() - resume_started, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Decoder::on_error(char const* what, int ret)
+{
+    control_.decode_errors_.fetch_add(1, std::memory_order_relaxed);
+    control_.keyframe_wanted_.store(true, std::memory_order_relaxed);
+
+    // pictures still in the codec may refer to what just failed
+    avcodec_flush_buffers(codec_context_.get());
+    damaged_pts_.clear();
+    awaiting_keyframe_ = true;
+
+    ++consecutive_errors_;
+    int budget = control_.error_budget_.load(std::memory_order_relaxed);
+    if (budget > 0 && consecutive_errors_ > budget) {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(ret, error, sizeof(error));
+        fail(std::string(what) + " " + std::to_string(consecutive_errors_) + " times in a row: " + error);
+    } else if constexpr (be_verbose) {
+        std::cout << what << std::endl;
     }
 }
 
+void Decoder::fail(std::string const& error)
+{
+    // slices are dropped from now on, the thread only waits to be stopped
+    is_failed_ = true;
+    error_slot_.set(error);
+}
+
 void Decoder::decode_loop()
 {
     for (;;) {
         // FIXME(bostjan): Prevent growing the queue too much
-        auto slice = queue_.pop();
+        auto queued_slice = queue_.pop();
+        auto const& slice = queued_slice.data_;
+        if (is_failed_) {
+            if (!queued_slice.is_flush_ && slice.empty()) {
+                break;
+            }
+            continue;
+        }
+        if (queued_slice.is_flush_) {
+            avcodec_flush_buffers(codec_context_.get());
+            damaged_pts_.clear();
+            parser_context_.reset(av_parser_init(codec_context_->codec_id));
+            if (!parser_context_) {
+                fail("failed to initialize parser");
+                continue;
+            }
+            // after anything decoded from slices queued before the flush
+            if (queued_slice.releases_frames_) {
+                channel_.release_frames();
+            }
+            continue;
+        }
         if (slice.empty()) {
             break;
         }
+        if (queued_slice.is_damaged_ && queued_slice.pts_ != AV_NOPTS_VALUE) {
+            damaged_pts_.insert(queued_slice.pts_);
+        }
+
+        // a reader now needs chroma, which the codec can't bring back for pictures in flight
+        if ((codec_context_->flags & AV_CODEC_FLAG_GRAY) != 0 && !control_.gray_.load(std::memory_order_relaxed)) {
+            try {
+                open();
+            } catch (std::runtime_error const& e) {
+                fail(e.what());
+                continue;
+            }
+            damaged_pts_.clear();
+            awaiting_keyframe_ = true;
+            control_.keyframe_wanted_.store(true, std::memory_order_relaxed);
+        }
 
         auto queue_size = queue_.size();
+        control_.queue_depth_.store(queue_size, std::memory_order_relaxed);
         // FIXME: Handle runaway queue
         if constexpr (be_verbose) {
             if (queue_size > 3) {
@@ -151,9 +300,9 @@ void Decoder::decode_loop()
         auto* packet = packet_.get();
         auto* frame = src_frame_.get();
 
-        while (cur_size > 0) {
+        while (cur_size > 0 && !is_failed_) {
             int len = av_parser_parse2(parser_context, codec_context, &packet->data, &packet->size,
-                cur_ptr, (int)cur_size, AV_NOPTS_VALUE /*pts*/, AV_NOPTS_VALUE,
+                cur_ptr, (int)cur_size, queued_slice.pts_, AV_NOPTS_VALUE,
                 /*AV_NOPTS_VALUE*/ -1);
 
             cur_ptr += len;
@@ -163,6 +312,16 @@ void Decoder::decode_loop()
                 continue;
             }
 
+            // the parser reports the pts of the slice that started the packet
+            packet->pts = parser_context->pts;
+
+            if (awaiting_keyframe_) {
+                if (parser_context->key_frame != 1) {
+                    continue;
+                }
+                awaiting_keyframe_ = false;
+            }
+
             if constexpr (be_verbose) {
                 std::cout << "[packet] size:" << packet->size << "\t";
                 switch (parser_context->pict_type) {
@@ -6,9 +6,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <fstream>
 #include <memory>
+#include <set>
 #include <thread>
 #include <vector>
 
@@ -17,8 +20,10 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include "error_slot.hpp"
+#include "frame_channel.hpp"
+#include "nal_unit.hpp"
 #include "queue.hpp"
-#include "swapper.hpp"
 #include "video_frame.hpp"
 
 namespace rtspcam {
@@ -50,24 +55,183 @@ struct AVCodecParserContextDeleter {
     void operator()(AVCodecParserContext* p) const { av_parser_close(p); }
 };
 
+// Returns the steady clock in microseconds, for times kept in atomics.
+inline int64_t steady_time_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Shared between a camera and its decoder. The camera writes the settings, the decoder reads them
+// and keeps the counters.
+struct DecoderControl {
+    DecoderControl()
+        : gray_(false)
+        , drop_nonref_(false)
+        , keyframes_only_(false)
+        , priority_(0)
+        , tier_(QualityTier::FULL)
+        , tier_changes_(0)
+        , packets_decoded_(0)
+        , units_discarded_(0)
+        , decode_time_(0)
+        , queue_depth_(0)
+        , resume_started_(0)
+        , resume_latency_(-1)
+        , last_packet_(0)
+        , describe_sent_(0)
+        , described_(0)
+        , playing_(0)
+        , first_packet_(0)
+        , first_keyframe_(0)
+        , first_frame_(0)
+        , keyframe_wanted_(false)
+        , keyframe_requests_(0)
+        , keyframe_recovery_(-1)
+        , packets_lost_(0)
+        , gaps_(0)
+        , frames_concealed_(0)
+        , loss_policy_(LossPolicy::CONCEAL)
+        , decode_errors_(0)
+        , error_budget_(100)
+    {
+    }
+
+    // Records the current time in `step`, unless it was reached before.
+    static void mark(std::atomic<int64_t>& step)
+    {
+        if (step.load(std::memory_order_relaxed) != 0) {
+            return;
+        }
+        int64_t not_reached = 0;
+        step.compare_exchange_strong(not_reached, steady_time_us(), std::memory_order_relaxed);
+    }
+
+    // settings combined with the tier the governor set
+    bool skip_loop_filter() const { return tier() >= QualityTier::NO_LOOP_FILTER; }
+    bool drop_nonref() const
+    {
+        return drop_nonref_.load(std::memory_order_relaxed) || tier() >= QualityTier::DROP_NONREF;
+    }
+    bool keyframes_only() const
+    {
+        return keyframes_only_.load(std::memory_order_relaxed) || tier() >= QualityTier::KEYFRAMES_ONLY;
+    }
+    QualityTier tier() const { return tier_.load(std::memory_order_relaxed); }
+
+    // Skip chroma decoding (AV_CODEC_FLAG_GRAY). Setting it takes effect when the next decoder is
+    // created. Clearing it makes a decoder that skips chroma start over at the next keyframe.
+    // Honoured only by libavcodec builds configured with --enable-gray.
+    std::atomic<bool> gray_;
+    // Discard frames no other frame refers to (AVDISCARD_NONREF), e.g. B-frames. Read for every
+    // packet. Streams made of I- and P-frames only lose nothing.
+    std::atomic<bool> drop_nonref_;
+    // Only parameter sets and IDR slices reach the decoder, everything else is dropped by the
+    // sink as it arrives. Read for every NAL unit.
+    std::atomic<bool> keyframes_only_;
+    std::atomic<int> priority_;
+    // written by the governor only
+    std::atomic<QualityTier> tier_;
+    std::atomic<uint64_t> tier_changes_;
+
+    std::atomic<uint64_t> packets_decoded_;
+    // NAL units dropped before decoding
+    std::atomic<uint64_t> units_discarded_;
+    // microseconds spent in libavcodec
+    std::atomic<uint64_t> decode_time_;
+    std::atomic<size_t> queue_depth_;
+    // Steady clock time in microseconds a paused stream was asked to resume, 0 if it wasn't. The
+    // decoder turns it into the latency of the first frame after that.
+    std::atomic<int64_t> resume_started_;
+    std::atomic<int64_t> resume_latency_;
+
+    // steady clock time of the latest NAL unit received
+    std::atomic<int64_t> last_packet_;
+
+    // steady clock times of the steps of starting the stream, see `mark`
+    std::atomic<int64_t> describe_sent_;
+    std::atomic<int64_t> described_;
+    std::atomic<int64_t> playing_;
+    std::atomic<int64_t> first_packet_;
+    std::atomic<int64_t> first_keyframe_;
+    std::atomic<int64_t> first_frame_;
+
+    // Set by the decoder when it produced a damaged picture, the sink asks the camera for a
+    // keyframe.
+    std::atomic<bool> keyframe_wanted_;
+    std::atomic<uint64_t> keyframe_requests_;
+    // microseconds from the oldest unanswered keyframe request to the next keyframe
+    std::atomic<int64_t> keyframe_recovery_;
+    // RTP packets that never arrived, the times they went missing and frames decoded from what
+    // arrived anyway
+    std::atomic<uint64_t> packets_lost_;
+    std::atomic<uint64_t> gaps_;
+    std::atomic<uint64_t> frames_concealed_;
+    // what the sink does after a gap, read for every NAL unit
+    std::atomic<LossPolicy> loss_policy_;
+
+    // Packets libavcodec refused or failed on. The decoder starts over at the next keyframe after
+    // each, and gives up on the stream after more than `error_budget_` in a row (0 never does).
+    std::atomic<uint64_t> decode_errors_;
+    std::atomic<int> error_budget_;
+};
+
+// Decodes on its own thread, which is started along with the codec by the first `send`. Until
+// then the decoder holds nothing but `extradata`. Nothing is thrown on that thread, errors the
+// decoder can't get past go to `error_slot`.
 class Decoder {
 public:
-    Decoder(Swapper<VideoFramePtr>& swapper, Slice extradata = {});
+    Decoder(FrameChannel& channel,
+        DecoderControl& control,
+        ErrorSlot& error_slot,
+        VideoCodec codec = VideoCodec::H264,
+        Slice extradata = {});
     ~Decoder();
-    void send(Slice slice, uint64_t pts);
+    // `pts` is the presentation time of the slice in microseconds since the epoch, it ends up in
+    // `AVFrame::pts` of the decoded frame. The frame of a slice that `is_damaged` gets
+    // AV_FRAME_FLAG_CORRUPT.
+    void send(Slice slice, int64_t pts, bool is_damaged = false);
+    // Drops partially parsed data, all reference frames and the frames readers haven't taken yet,
+    // so that no frame buffers are held. Decoding has to start over at a keyframe.
+    void flush();
+    // Drops partially parsed data and all reference frames, but leaves decoded frames and spare
+    // buffers alone. For a stream that starts over, e.g. after reconnecting.
+    void restart();
 
 private:
+    struct QueuedSlice {
+        std::vector<uint8_t> data_;
+        int64_t pts_;
+        bool is_flush_ = false;
+        bool releases_frames_ = false;
+        bool is_damaged_ = false;
+    };
+
     std::unique_ptr<AVCodecContext, AVCodecContextDeleter> codec_context_;
     std::unique_ptr<AVCodecParserContext, AVCodecParserContextDeleter> parser_context_;
     VideoFramePtr src_frame_;
     std::unique_ptr<AVPacket, AVPacketDeleter> packet_;
-    Swapper<VideoFramePtr>& swapper_;
+    VideoCodec codec_;
+    std::vector<uint8_t> extradata_;
+    FrameChannel& channel_;
+    DecoderControl& control_;
+    ErrorSlot& error_slot_;
     bool first_frame_;
+    // packets are dropped until a keyframe after an error
+    bool awaiting_keyframe_;
+    int consecutive_errors_;
+    bool is_failed_;
+    // presentation times of frames decoded from damaged slices, not output yet
+    std::set<int64_t> damaged_pts_;
     std::thread thread_;
-    Queue<std::vector<uint8_t>> queue_;
+    Queue<QueuedSlice> queue_;
 
+    void open();
     void decode();
     void decode_loop();
+    void on_error(char const* what, int ret);
+    void fail(std::string const& error);
 };
 
 } // namespace rtspcam
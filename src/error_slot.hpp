@@ -7,20 +7,37 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <optional>
 #include <string>
 
 class ErrorSlot {
 public:
     ErrorSlot()
-        : errored_(false)
+        : claimed_(false)
+        , errored_(false)
     {
     }
 
+    // The first error sticks, later ones are dropped. Any thread.
     void set(std::string const& error)
     {
+        if (claimed_.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+
         error_ = error;
         errored_.store(true, std::memory_order_release);
+
+        if (listener_) {
+            listener_(error);
+        }
+    }
+
+    // Sets a function called on the thread setting the error. Must be set before the first error.
+    void set_listener(std::function<void(std::string const&)> listener)
+    {
+        listener_ = std::move(listener);
     }
 
     std::optional<std::string> check()
@@ -32,6 +49,8 @@ public:
     }
 
 private:
+    std::atomic<bool> claimed_;
     std::atomic<bool> errored_;
     std::string error_;
+    std::function<void(std::string const&)> listener_;
 };
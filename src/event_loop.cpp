@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "event_loop.hpp"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+
+using namespace rtspcam;
+
+static thread_local bool on_loop_thread = false;
+
+void UsageEnvironmentDeleter::operator()(UsageEnvironment* p)
+{
+    auto ret = p->reclaim();
+    // FIXME(bostjan)
+    if (ret == False) {
+        std::cout << "not reclaimed" << std::endl;
+    }
+}
+
+EventLoop::EventLoop()
+    : scheduler_(BasicTaskScheduler::createNew())
+    , environment_(BasicUsageEnvironment::createNew(*scheduler_), UsageEnvironmentDeleter())
+    , quit_flag_(0)
+{
+    post_trigger_ = scheduler_->createEventTrigger([](void* data) {
+        static_cast<EventLoop*>(data)->run_posted();
+    });
+
+    thread_ = std::thread([this]() {
+        on_loop_thread = true;
+        scheduler_->doEventLoop(&quit_flag_);
+    });
+}
+
+EventLoop::~EventLoop()
+{
+    post([this]() { quit_flag_ = 1; });
+    thread_.join();
+    scheduler_->deleteEventTrigger(post_trigger_);
+}
+
+std::shared_ptr<EventLoop> EventLoop::shared()
+{
+    static std::mutex mutex;
+    static std::vector<std::weak_ptr<EventLoop>> loops(std::max(1u, std::thread::hardware_concurrency()));
+    static size_t next = 0;
+
+    std::scoped_lock lock(mutex);
+    auto& slot = loops[next];
+    next = (next + 1) % loops.size();
+
+    auto loop = slot.lock();
+    if (!loop) {
+        loop = std::make_shared<EventLoop>();
+        slot = loop;
+    }
+    return loop;
+}
+
+bool EventLoop::is_loop_thread()
+{
+    return on_loop_thread;
+}
+
+void EventLoop::post(std::function<void()> task)
+{
+    {
+        std::scoped_lock lock(mutex_);
+        posted_.push_back(std::move(task));
+    }
+    // the only scheduler call that may come from another thread
+    scheduler_->triggerEvent(post_trigger_, this);
+}
+
+void EventLoop::run(std::function<void()> task)
+{
+    if (std::this_thread::get_id() == thread_.get_id()) {
+        task();
+        return;
+    }
+
+    std::promise<void> done;
+    post([&]() {
+        try {
+            task();
+            done.set_value();
+        } catch (...) {
+            done.set_exception(std::current_exception());
+        }
+    });
+    done.get_future().get();
+}
+
+void EventLoop::run_posted()
+{
+    // triggers don't queue, one run takes everything posted so far
+    std::vector<std::function<void()>> posted;
+    {
+        std::scoped_lock lock(mutex_);
+        posted.swap(posted_);
+    }
+
+    for (auto& task : posted) {
+        task();
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <BasicUsageEnvironment.hh>
+
+namespace rtspcam {
+
+struct UsageEnvironmentDeleter {
+    void operator()(UsageEnvironment* p);
+};
+
+// A live555 task scheduler running on its own thread. Any number of RTSP clients can share one,
+// everything they do happens on its thread. Other threads hand work over with `post`, which
+// needs a single event trigger however many clients there are (a scheduler has 32).
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(EventLoop const&) = delete;
+    EventLoop& operator=(EventLoop const&) = delete;
+
+    // A loop of the process-wide pool, one per core, handed out in turn. A loop lives while
+    // anyone holds it.
+    static std::shared_ptr<EventLoop> shared();
+    // Whether the calling thread is the thread of any loop.
+    static bool is_loop_thread();
+
+    // Only to be used on the loop's thread.
+    UsageEnvironment& environment() { return *environment_; }
+
+    // Runs `task` on the loop's thread, tasks run in the order they were posted. Any thread.
+    void post(std::function<void()> task);
+    // Runs `task` on the loop's thread and waits for it to finish. Runs it right away when
+    // called on the loop's thread.
+    void run(std::function<void()> task);
+
+private:
+    void run_posted();
+
+    std::unique_ptr<TaskScheduler> scheduler_;
+    std::unique_ptr<UsageEnvironment, UsageEnvironmentDeleter> environment_;
+    EventTriggerId post_trigger_;
+    std::mutex mutex_;
+    std::vector<std::function<void()>> posted_;
+    char quit_flag_;
+    std::thread thread_;
+};
+
+} // namespace rtspcam
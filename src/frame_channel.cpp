@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "frame_channel.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace rtspcam;
+
+static size_t capacity_of(Delivery const& delivery)
+{
+    return delivery.mode_ == DeliveryMode::QUEUE ? std::max<size_t>(delivery.queue_size_, 1) : 1;
+}
+
+FrameSubscription::FrameSubscription(Delivery const& delivery)
+    : capacity_(capacity_of(delivery))
+    , is_blocking_(delivery.mode_ == DeliveryMode::QUEUE && delivery.block_)
+    , last_decimated_(0)
+    , skipped_(0)
+    , period_(0)
+    , decimated_(0)
+    , active_calls_(0)
+    , is_detached_(false)
+{
+}
+
+void FrameSubscription::set_delivery(Delivery const& delivery)
+{
+    {
+        std::scoped_lock lock(mutex_);
+        capacity_ = capacity_of(delivery);
+        is_blocking_ = delivery.mode_ == DeliveryMode::QUEUE && delivery.block_;
+
+        while (entries_.size() > capacity_) {
+            av_frame_unref(entries_.front().frame_.get());
+            free_frames_.push_back(std::move(entries_.front().frame_));
+            entries_.pop_front();
+        }
+    }
+
+    // a publisher waiting for space may not need to anymore
+    space_condvar_.notify_all();
+}
+
+void FrameSubscription::set_max_rate(double fps)
+{
+    std::scoped_lock lock(mutex_);
+    period_ = fps > 0 ? (int64_t)std::llround(1e6 / fps) : 0;
+    next_due_.reset();
+}
+
+void FrameSubscription::push(AVFrame const* frame, uint64_t frame_index)
+{
+    if (!enter()) {
+        return;
+    }
+
+    // frames without a presentation time are paced by arrival
+    int64_t const time = frame->pts != AV_NOPTS_VALUE
+        ? frame->pts
+        : std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+              .count();
+
+    VideoFramePtr ref;
+    bool is_dropped = false;
+    uint64_t decimated = 0;
+
+    {
+        std::scoped_lock lock(mutex_);
+        if (!is_due(time)) {
+            decimated_ += 1;
+            is_dropped = true;
+        } else if (!free_frames_.empty()) {
+            ref = std::move(free_frames_.back());
+            free_frames_.pop_back();
+        }
+        decimated = decimated_;
+    }
+
+    // nothing is referenced or converted for a frame that isn't due
+    if (is_dropped) {
+        leave();
+        return;
+    }
+
+    if (!ref) {
+        ref = make_videoframe();
+    }
+
+    // a frame that can't be referenced is lost, it shows up as skipped
+    if (!ref || av_frame_ref(ref.get(), frame) != 0) {
+        leave();
+        return;
+    }
+
+    {
+        std::unique_lock lock(mutex_);
+        if (is_blocking_) {
+            space_condvar_.wait(lock, [this]() { return is_detached_ || entries_.size() < capacity_; });
+            if (is_detached_) {
+                lock.unlock();
+                leave();
+                return;
+            }
+        }
+
+        // the oldest frame makes room, the reader sees the gap in frame indices
+        if (entries_.size() >= capacity_) {
+            av_frame_unref(entries_.front().frame_.get());
+            free_frames_.push_back(std::move(entries_.front().frame_));
+            entries_.pop_front();
+        }
+        entries_.push_back({ std::move(ref), frame_index, decimated });
+    }
+
+    condvar_.notify_one();
+
+    if (listener_) {
+        listener_();
+    }
+
+    leave();
+}
+
+void FrameSubscription::set_error(std::string const& error)
+{
+    if (!enter()) {
+        return;
+    }
+
+    error_slot_.set(error);
+
+    leave();
+}
+
+void FrameSubscription::clear()
+{
+    std::scoped_lock lock(mutex_);
+    entries_.clear();
+    free_frames_.clear();
+    space_condvar_.notify_all();
+}
+
+void FrameSubscription::detach()
+{
+    std::unique_lock lock(mutex_);
+    is_detached_ = true;
+    // releases a publisher blocked on a full queue
+    space_condvar_.notify_all();
+    idle_condvar_.wait(lock, [this]() { return active_calls_ == 0; });
+}
+
+bool FrameSubscription::is_due(int64_t time)
+{
+    if (period_ == 0) {
+        return true;
+    }
+
+    // a little slack keeps jitter from pushing every other frame past its slot
+    int64_t const slack = period_ / 10;
+    if (next_due_ && time < next_due_.value() - slack && time >= next_due_.value() - 2 * period_) {
+        return false;
+    }
+
+    // keeps the cadence, unless the stream stalled or its clock jumped
+    if (next_due_ && time >= next_due_.value() - slack && time < next_due_.value() + period_) {
+        next_due_ = next_due_.value() + period_;
+    } else {
+        next_due_ = time + period_;
+    }
+    return true;
+}
+
+bool FrameSubscription::enter()
+{
+    std::scoped_lock lock(mutex_);
+    if (is_detached_) {
+        return false;
+    }
+    active_calls_ += 1;
+    return true;
+}
+
+void FrameSubscription::leave()
+{
+    bool is_idle = false;
+    {
+        std::scoped_lock lock(mutex_);
+        active_calls_ -= 1;
+        is_idle = active_calls_ == 0 && is_detached_;
+    }
+
+    if (is_idle) {
+        idle_condvar_.notify_all();
+    }
+}
+
+std::optional<std::pair<VideoFramePtr, uint64_t>> FrameSubscription::try_pop(VideoFramePtr&& frame,
+    std::chrono::milliseconds timeout,
+    uint64_t* decimated)
+{
+    std::unique_lock lock(mutex_);
+    if (!condvar_.wait_for(lock, timeout, [this]() { return !entries_.empty(); })) {
+        return {};
+    }
+
+    auto entry = std::move(entries_.front());
+    entries_.pop_front();
+    if (is_blocking_) {
+        space_condvar_.notify_one();
+    }
+
+    if (frame) {
+        av_frame_unref(frame.get());
+        free_frames_.push_back(std::move(frame));
+    }
+
+    // frames the rate limit dropped in between were not missed
+    if (last_index_) {
+        skipped_ += entry.frame_index_ - last_index_.value() - 1 - (entry.decimated_ - last_decimated_);
+    }
+    last_index_ = entry.frame_index_;
+    last_decimated_ = entry.decimated_;
+    if (decimated) {
+        *decimated = entry.decimated_;
+    }
+
+    return std::make_pair(std::move(entry.frame_), entry.frame_index_);
+}
+
+bool FrameSubscription::has_pending()
+{
+    std::scoped_lock lock(mutex_);
+    return !entries_.empty();
+}
+
+uint64_t FrameSubscription::skipped()
+{
+    std::scoped_lock lock(mutex_);
+    return skipped_;
+}
+
+uint64_t FrameSubscription::decimated()
+{
+    std::scoped_lock lock(mutex_);
+    return decimated_;
+}
+
+void FrameSubscription::set_listener(std::function<void()> listener)
+{
+    listener_ = std::move(listener);
+}
+
+FrameChannel::FrameChannel()
+    : frame_index_(0)
+{
+}
+
+void FrameChannel::attach(std::shared_ptr<FrameSubscription> const& subscription)
+{
+    std::optional<std::string> error;
+    {
+        std::scoped_lock lock(mutex_);
+        subscriptions_.push_back(subscription);
+        error = error_;
+    }
+
+    if (error) {
+        subscription->set_error(error.value());
+    }
+}
+
+void FrameChannel::publish(AVFrame const* frame)
+{
+    // pushes run without the channel lock, a slow listener must not block attaching readers
+    uint64_t const frame_index = frame_index_.load(std::memory_order_relaxed);
+    for (auto const& subscription : lock_subscriptions()) {
+        subscription->push(frame, frame_index);
+    }
+    frame_index_.store(frame_index + 1, std::memory_order_relaxed);
+}
+
+void FrameChannel::close(std::string const& error)
+{
+    {
+        std::scoped_lock lock(mutex_);
+        if (error_) {
+            return;
+        }
+        error_ = error;
+    }
+
+    for (auto const& subscription : lock_subscriptions()) {
+        subscription->set_error(error);
+    }
+}
+
+void FrameChannel::release_frames()
+{
+    for (auto const& subscription : lock_subscriptions()) {
+        subscription->clear();
+    }
+}
+
+std::vector<std::shared_ptr<FrameSubscription>> FrameChannel::lock_subscriptions()
+{
+    std::vector<std::shared_ptr<FrameSubscription>> subscriptions;
+
+    std::scoped_lock lock(mutex_);
+    subscriptions.reserve(subscriptions_.size());
+    subscriptions_.erase(std::remove_if(subscriptions_.begin(), subscriptions_.end(),
+                             [&](auto const& weak) {
+                                 auto subscription = weak.lock();
+                                 if (!subscription) {
+                                     return true;
+                                 }
+                                 subscriptions.push_back(std::move(subscription));
+                                 return false;
+                             }),
+        subscriptions_.end());
+
+    return subscriptions;
+}
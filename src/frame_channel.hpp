@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "error_slot.hpp"
+#include "rtsp_camera.hpp"
+#include "video_frame.hpp"
+
+namespace rtspcam {
+
+// One reader's view of a `FrameChannel`. Frames are references to the decoder's buffers, no
+// pixels are copied. Has the same pop contract as `Swapper`: the frame passed in is taken back
+// for reuse and the popped one is returned together with its index.
+class FrameSubscription {
+public:
+    explicit FrameSubscription(Delivery const& delivery);
+
+    void set_delivery(Delivery const& delivery);
+    // Drops frames that come sooner than 1/`fps` seconds of presentation time after the last one
+    // kept, 0 keeps all of them. Dropped frames keep their frame indices but don't count as
+    // skipped.
+    void set_max_rate(double fps);
+
+    // Called by the channel on the decoder thread.
+    void push(AVFrame const* frame, uint64_t frame_index);
+
+    // `decimated` receives the number of frames the rate limit dropped before the popped one.
+    std::optional<std::pair<VideoFramePtr, uint64_t>> try_pop(VideoFramePtr&& frame,
+        std::chrono::milliseconds timeout,
+        uint64_t* decimated = nullptr);
+    // Returns whether `try_pop` would return without waiting.
+    bool has_pending();
+    // Returns number of frames this subscription never saw, because they were overwritten or
+    // dropped from a full queue.
+    uint64_t skipped();
+    // Returns number of frames dropped by the rate limit.
+    uint64_t decimated();
+
+    // Sets a function called on the decoder thread after every push, without holding the lock.
+    // Must be set before the subscription is attached to a channel.
+    void set_listener(std::function<void()> listener);
+    // Called by the channel when the stream ends.
+    void set_error(std::string const& error);
+    // Drops pending frames and spare buffers, see `FrameChannel::release_frames`.
+    void clear();
+    // Holds the error that closed the channel. Its listener is subject to the same rules as the
+    // frame listener.
+    ErrorSlot& error_slot() { return error_slot_; }
+    // Stops calling listeners and waits for the ones still running. Listeners must not detach
+    // their own subscription.
+    void detach();
+
+private:
+    bool enter();
+    void leave();
+    bool is_due(int64_t time);
+
+    struct Entry {
+        VideoFramePtr frame_;
+        uint64_t frame_index_;
+        // `decimated_` when the frame was pushed
+        uint64_t decimated_;
+    };
+
+    size_t capacity_;
+    bool is_blocking_;
+    std::mutex mutex_;
+    std::condition_variable condvar_;
+    // signalled when a pop makes room in a full blocking queue
+    std::condition_variable space_condvar_;
+    std::deque<Entry> entries_;
+    // unreferenced frames, reused so that steady state pushes don't allocate
+    std::vector<VideoFramePtr> free_frames_;
+    std::optional<uint64_t> last_index_;
+    uint64_t last_decimated_;
+    uint64_t skipped_;
+    // rate limit, times in microseconds
+    int64_t period_;
+    std::optional<int64_t> next_due_;
+    uint64_t decimated_;
+    std::function<void()> listener_;
+    ErrorSlot error_slot_;
+
+    // publisher calls in flight, `detach` waits for them
+    std::condition_variable idle_condvar_;
+    int active_calls_;
+    bool is_detached_;
+};
+
+// Broadcasts decoded frames to any number of subscriptions, so that many readers share a single
+// RTSP session and decoder.
+class FrameChannel {
+public:
+    FrameChannel();
+
+    // Subscriptions are held weakly, a subscription that is gone is dropped on the next publish.
+    void attach(std::shared_ptr<FrameSubscription> const& subscription);
+    // Called on the decoder thread. Every subscription gets its own reference to `frame`.
+    void publish(AVFrame const* frame);
+    // Reports the error that ended the stream to every subscription, present and future.
+    void close(std::string const& error);
+    // Drops the frames every subscription holds on to, so the decoder's buffers can be freed while
+    // the stream is paused. Readers see the dropped frames as skipped.
+    void release_frames();
+    // Returns number of frames published so far.
+    uint64_t published() const { return frame_index_.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<std::shared_ptr<FrameSubscription>> lock_subscriptions();
+
+    std::mutex mutex_;
+    std::vector<std::weak_ptr<FrameSubscription>> subscriptions_;
+    std::optional<std::string> error_;
+    // written by the publisher thread only
+    std::atomic<uint64_t> frame_index_;
+};
+
+} // namespace rtspcam
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "frame_converter.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+using namespace rtspcam;
+
+static bool has_gray8_luma_plane(AVPixelFormat pixfmt);
+static std::optional<Yuv420Planes> yuv420_planes(AVFrame const* frame);
+static Rect align_roi(Rect const& roi, AVFrame const* frame);
+static void crop_videoframe(AVFrame const* src_frame, Rect const& roi, AVFrame* dst_frame);
+
+FrameConverter::FrameConverter()
+    : roi_frame_(make_videoframe())
+    , format_(ImageFormat::RGB)
+    , pixel_format_(AV_PIX_FMT_RGB24)
+    , width_(0)
+    , height_(0)
+    , num_threads_(1)
+    , src_width_(0)
+    , src_height_(0)
+    , src_pixfmt_(AV_PIX_FMT_NONE)
+    , is_configured_(false)
+    , zero_copy_luma_(false)
+{
+}
+
+void FrameConverter::set_format(ImageFormat format)
+{
+    format_ = format;
+    AVPixelFormat pixel_format = AV_PIX_FMT_RGB24;
+
+    switch (format) {
+    case ImageFormat::RGB:
+        pixel_format = AV_PIX_FMT_RGB24;
+        break;
+    case ImageFormat::BGR:
+        pixel_format = AV_PIX_FMT_BGR24;
+        break;
+    case ImageFormat::GRAY:
+        pixel_format = AV_PIX_FMT_GRAY8;
+        break;
+    }
+
+    if (pixel_format != pixel_format_) {
+        pixel_format_ = pixel_format;
+        is_configured_ = false;
+    }
+}
+
+void FrameConverter::set_size(int width, int height)
+{
+    if (width != width_ || height != height_) {
+        width_ = width;
+        height_ = height;
+        is_configured_ = false;
+    }
+}
+
+void FrameConverter::set_roi(std::optional<Rect> const& roi)
+{
+    // a changed roi of the same size reuses the scaler, only plane offsets differ
+    roi_ = roi;
+}
+
+void FrameConverter::set_threads(int num_threads)
+{
+    if (num_threads != num_threads_) {
+        num_threads_ = num_threads;
+        is_configured_ = false;
+    }
+}
+
+void FrameConverter::set_spec(OutputSpec const& spec)
+{
+    set_format(spec.format_);
+    set_size(spec.width_, spec.height_);
+    set_roi(spec.roi_);
+}
+
+Image FrameConverter::convert(AVFrame const* src_frame, uint64_t frame_index)
+{
+    bool is_corrupt = (src_frame->flags & AV_FRAME_FLAG_CORRUPT) != 0;
+    src_frame = prepare(src_frame);
+    int64_t timestamp = src_frame->pts == AV_NOPTS_VALUE ? -1 : src_frame->pts;
+
+    if (zero_copy_luma_) {
+        // the image holds its own reference, so the decoder will not reuse the plane under it
+        Image image(src_frame->data[0], (size_t)src_frame->linesize[0] * src_frame->height,
+            frame_index, src_frame->width, src_frame->height, src_frame->linesize[0],
+            ImageFormat::GRAY, share_videoframe(ref_videoframe(src_frame)));
+        image.timestamp_ = timestamp;
+        image.is_corrupt_ = is_corrupt;
+        image.is_shared_ = true;
+        return image;
+    }
+
+    auto image = video_scaler_.convert(src_frame, frame_index);
+    image.timestamp_ = timestamp;
+    image.is_corrupt_ = is_corrupt;
+    return image;
+}
+
+void FrameConverter::convert_into(AVFrame const* src_frame, uint8_t* dst, int dst_stride)
+{
+    if (width_ == 0 || height_ == 0) {
+        throw std::runtime_error("Converting into a buffer needs a fixed image size");
+    }
+
+    src_frame = prepare(src_frame);
+
+    if (zero_copy_luma_) {
+        av_image_copy_plane(dst, dst_stride, src_frame->data[0], src_frame->linesize[0],
+            src_frame->width, src_frame->height);
+        return;
+    }
+
+    video_scaler_.convert_into(src_frame, dst, dst_stride);
+}
+
+Image FrameConverter::convert_to_tensor(AVFrame const* src_frame, uint64_t frame_index,
+    TensorFormat const& format, void* dst, size_t size)
+{
+    auto image = describe(src_frame, frame_index);
+    if (tensor_size(image, format) > size) {
+        throw std::runtime_error("Tensor buffer too small");
+    }
+
+    auto planes = yuv420_planes(roi_ ? roi_frame_.get() : src_frame);
+    if (!planes) {
+        image = convert(src_frame, frame_index);
+        rtspcam::convert_to_tensor(image, format, dst);
+        return image;
+    }
+
+    rtspcam::convert_to_tensor(planes.value(), image, format, dst);
+    return image;
+}
+
+Image FrameConverter::describe(AVFrame const* src_frame, uint64_t frame_index)
+{
+    src_frame = crop(src_frame);
+
+    int width = width_;
+    int height = height_;
+    if (width == 0 || height == 0) {
+        width = src_frame->width;
+        height = src_frame->height;
+    }
+
+    // the cropped frame carries the properties of the source frame
+    Image image(nullptr, 0, frame_index, width, height, 0, format_);
+    image.timestamp_ = src_frame->pts == AV_NOPTS_VALUE ? -1 : src_frame->pts;
+    image.is_corrupt_ = (src_frame->flags & AV_FRAME_FLAG_CORRUPT) != 0;
+    return image;
+}
+
+AVFrame const* FrameConverter::crop(AVFrame const* src_frame)
+{
+    if (roi_) {
+        crop_videoframe(src_frame, align_roi(roi_.value(), src_frame), roi_frame_.get());
+        src_frame = roi_frame_.get();
+    }
+    return src_frame;
+}
+
+AVFrame const* FrameConverter::prepare(AVFrame const* src_frame)
+{
+    src_frame = crop(src_frame);
+
+    if (!is_configured_ || src_frame->width != src_width_ || src_frame->height != src_height_
+        || src_frame->format != src_pixfmt_) {
+        configure(src_frame);
+    }
+
+    return src_frame;
+}
+
+void FrameConverter::configure(AVFrame const* src_frame)
+{
+    auto width = src_frame->width;
+    auto height = src_frame->height;
+    auto src_pixfmt = (AVPixelFormat)src_frame->format;
+
+    auto dst_width = width_;
+    auto dst_height = height_;
+    if (dst_width == 0 || dst_height == 0) {
+        dst_width = width;
+        dst_height = height;
+    }
+
+    zero_copy_luma_ = false;
+    if (pixel_format_ == AV_PIX_FMT_GRAY8 && has_gray8_luma_plane(src_pixfmt)) {
+        // the Y plane already is the grayscale image, chroma is never touched
+        zero_copy_luma_ = dst_width == width && dst_height == height;
+        src_pixfmt = AV_PIX_FMT_GRAY8;
+    }
+
+    if (!zero_copy_luma_) {
+        video_scaler_.initialize(width, height, src_pixfmt, dst_width, dst_height, pixel_format_,
+            num_threads_);
+    }
+
+    src_width_ = width;
+    src_height_ = height;
+    src_pixfmt_ = src_frame->format;
+    is_configured_ = true;
+}
+
+static bool has_gray8_luma_plane(AVPixelFormat pixfmt)
+{
+    // 8-bit yuv formats (planar and semi-planar) store luma as a tightly packed first plane
+    auto const* desc = av_pix_fmt_desc_get(pixfmt);
+    return desc != nullptr && (desc->flags & AV_PIX_FMT_FLAG_RGB) == 0 && desc->nb_components >= 1
+        && desc->comp[0].plane == 0 && desc->comp[0].step == 1 && desc->comp[0].depth == 8;
+}
+
+static std::optional<Yuv420Planes> yuv420_planes(AVFrame const* frame)
+{
+    // like libswscale, only the yuvj formats are taken as full range
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        if (frame->linesize[1] != frame->linesize[2]) {
+            return std::nullopt;
+        }
+        return Yuv420Planes { frame->data[0], frame->data[1], frame->data[2], frame->linesize[0],
+            frame->linesize[1], frame->width, frame->height, false, frame->format == AV_PIX_FMT_YUVJ420P };
+    case AV_PIX_FMT_NV12:
+        return Yuv420Planes { frame->data[0], frame->data[1], nullptr, frame->linesize[0],
+            frame->linesize[1], frame->width, frame->height, true, false };
+    default:
+        return std::nullopt;
+    }
+}
+
+static Rect align_roi(Rect const& roi, AVFrame const* frame)
+{
+    auto const* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (desc == nullptr || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) != 0) {
+        throw std::runtime_error("Region of interest is not supported for this pixel format");
+    }
+
+    // snap the top left corner to the chroma grid, so that chroma planes are offset by whole
+    // samples and stay aligned with luma
+    int const x_mask = ~((1 << desc->log2_chroma_w) - 1);
+    int const y_mask = ~((1 << desc->log2_chroma_h) - 1);
+
+    int x0 = std::clamp(roi.x_, 0, frame->width) & x_mask;
+    int y0 = std::clamp(roi.y_, 0, frame->height) & y_mask;
+    int x1 = std::clamp(roi.x_ + roi.width_, 0, frame->width);
+    int y1 = std::clamp(roi.y_ + roi.height_, 0, frame->height);
+
+    if (x1 <= x0 || y1 <= y0) {
+        throw std::runtime_error("Region of interest is outside of the frame");
+    }
+
+    return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+static void crop_videoframe(AVFrame const* src_frame, Rect const& roi, AVFrame* dst_frame)
+{
+    // a new reference shares the decoded buffers, only plane pointers of `dst_frame` move
+    av_frame_unref(dst_frame);
+    if (av_frame_ref(dst_frame, src_frame) != 0) {
+        throw std::runtime_error("Failed to reference video frame");
+    }
+
+    dst_frame->crop_left = roi.x_;
+    dst_frame->crop_top = roi.y_;
+    dst_frame->crop_right = src_frame->width - roi.x_ - roi.width_;
+    dst_frame->crop_bottom = src_frame->height - roi.y_ - roi.height_;
+
+    // corners are already on the chroma grid, skip libavutil's rounding to simd alignment
+    if (av_frame_apply_cropping(dst_frame, AV_FRAME_CROP_UNALIGNED) != 0) {
+        throw std::runtime_error("Failed to crop video frame");
+    }
+}
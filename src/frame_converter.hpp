@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+#include "image.hpp"
+#include "tensor.hpp"
+#include "video_frame.hpp"
+#include "video_scaler.hpp"
+
+namespace rtspcam {
+
+// Turns decoded frames into images of a given format, size and region of interest. The scaler
+// is rebuilt whenever the settings or the geometry of incoming frames change.
+class FrameConverter {
+public:
+    FrameConverter();
+
+    void set_format(ImageFormat format);
+    // 0x0 keeps the size of the (cropped) source frame.
+    void set_size(int width, int height);
+    void set_roi(std::optional<Rect> const& roi);
+    void set_threads(int num_threads);
+    void set_spec(OutputSpec const& spec);
+
+    Image convert(AVFrame const* src_frame, uint64_t frame_index);
+    // Converts into caller owned memory, see `VideoScaler::convert_into`. The size must be set.
+    void convert_into(AVFrame const* src_frame, uint8_t* dst, int dst_stride);
+    // Converts into a tensor of `format` in `dst`, which holds `size` bytes. 4:2:0 frames are
+    // resized, converted and normalized in a single pass, other formats go through the scaler.
+    // Returns the image the tensor holds, without pixels after a single pass.
+    Image convert_to_tensor(AVFrame const* src_frame, uint64_t frame_index, TensorFormat const& format,
+        void* dst, size_t size);
+    // Returns what `convert` would make of `src_frame` without converting it, no pixels.
+    Image describe(AVFrame const* src_frame, uint64_t frame_index);
+
+private:
+    AVFrame const* crop(AVFrame const* src_frame);
+    AVFrame const* prepare(AVFrame const* src_frame);
+    void configure(AVFrame const* src_frame);
+
+    VideoScaler video_scaler_;
+    VideoFramePtr roi_frame_;
+    ImageFormat format_;
+    AVPixelFormat pixel_format_;
+    int width_;
+    int height_;
+    std::optional<Rect> roi_;
+    int num_threads_;
+
+    // geometry the scaler was configured for
+    int src_width_;
+    int src_height_;
+    int src_pixfmt_;
+    bool is_configured_;
+    bool zero_copy_luma_;
+};
+
+} // namespace rtspcam
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "governor.hpp"
+#include "decoder.hpp"
+
+#include <algorithm>
+
+using namespace rtspcam;
+
+static QualityTier lower(QualityTier tier)
+{
+    return tier == QualityTier::KEYFRAMES_ONLY ? tier : (QualityTier)((int)tier + 1);
+}
+
+static QualityTier higher(QualityTier tier)
+{
+    return tier == QualityTier::FULL ? tier : (QualityTier)((int)tier - 1);
+}
+
+Governor& Governor::instance()
+{
+    // constructed by the first session, so it outlives all of them
+    static Governor governor;
+    return governor;
+}
+
+Governor::Governor()
+    : calm_intervals_(0)
+    , is_enabled_(false)
+{
+}
+
+Governor::~Governor()
+{
+    disable();
+}
+
+void Governor::enable(GovernorConfig const& config)
+{
+    std::scoped_lock lock(mutex_);
+    config_ = config;
+    calm_intervals_ = 0;
+    if (!is_enabled_) {
+        is_enabled_ = true;
+        thread_ = std::thread([this]() { run(); });
+    }
+}
+
+void Governor::disable()
+{
+    {
+        std::scoped_lock lock(mutex_);
+        if (!is_enabled_) {
+            return;
+        }
+        is_enabled_ = false;
+    }
+    condvar_.notify_all();
+    thread_.join();
+
+    std::vector<TierChange> changes;
+    std::shared_ptr<TierCallback const> callback;
+    {
+        std::scoped_lock lock(mutex_);
+        for (auto& stream : streams_) {
+            if (stream.control_->tier() != QualityTier::FULL) {
+                changes.push_back(set_tier(stream, QualityTier::FULL, 0.0));
+            }
+        }
+        callback = callback_;
+    }
+
+    if (callback) {
+        for (auto const& change : changes) {
+            (*callback)(change);
+        }
+    }
+}
+
+void Governor::on_change(TierCallback callback)
+{
+    std::scoped_lock lock(mutex_);
+    if (callback) {
+        callback_ = std::make_shared<TierCallback const>(std::move(callback));
+    } else {
+        callback_.reset();
+    }
+}
+
+void Governor::add(DecoderControl& control, std::string const& url)
+{
+    std::scoped_lock lock(mutex_);
+    streams_.push_back({ &control, url, control.decode_time_.load(std::memory_order_relaxed), 0.0 });
+}
+
+void Governor::remove(DecoderControl& control)
+{
+    std::scoped_lock lock(mutex_);
+    streams_.erase(std::remove_if(streams_.begin(), streams_.end(),
+                       [&](auto const& stream) { return stream.control_ == &control; }),
+        streams_.end());
+}
+
+void Governor::run()
+{
+    auto last_sample = std::chrono::steady_clock::now();
+
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        condvar_.wait_for(lock, config_.interval_, [this]() { return !is_enabled_; });
+        if (!is_enabled_) {
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto changes = sample(std::chrono::duration_cast<std::chrono::microseconds>(now - last_sample));
+        last_sample = now;
+
+        // callbacks run without the lock, they may add or remove streams
+        auto callback = callback_;
+        lock.unlock();
+        if (callback) {
+            for (auto const& change : changes) {
+                (*callback)(change);
+            }
+        }
+        lock.lock();
+    }
+}
+
+std::vector<TierChange> Governor::sample(std::chrono::microseconds elapsed)
+{
+    if (elapsed.count() <= 0) {
+        return {};
+    }
+
+    double busy = 0.0;
+    bool is_backlogged = false;
+    for (auto& stream : streams_) {
+        uint64_t decode_time = stream.control_->decode_time_.load(std::memory_order_relaxed);
+        stream.busy_ = (double)(decode_time - stream.last_decode_time_) / (double)elapsed.count();
+        stream.last_decode_time_ = decode_time;
+        busy += stream.busy_;
+        is_backlogged = is_backlogged
+            || stream.control_->queue_depth_.load(std::memory_order_relaxed) > config_.max_queue_depth_;
+    }
+
+    double load = busy / std::max(1u, std::thread::hardware_concurrency());
+    bool is_overloaded = load > config_.max_load_;
+
+    if (is_overloaded || is_backlogged) {
+        calm_intervals_ = 0;
+
+        // Lowest priority first, among equals the most expensive stream. A backlog on an
+        // otherwise idle host is a stream too heavy for its decoder thread, only lowering that
+        // one helps.
+        Stream* degraded = nullptr;
+        for (auto& stream : streams_) {
+            auto const& control = *stream.control_;
+            if (control.tier() == QualityTier::KEYFRAMES_ONLY) {
+                continue;
+            }
+            if (!is_overloaded
+                && control.queue_depth_.load(std::memory_order_relaxed) <= config_.max_queue_depth_) {
+                continue;
+            }
+
+            int priority = control.priority_.load(std::memory_order_relaxed);
+            if (!degraded || priority < degraded->control_->priority_.load(std::memory_order_relaxed)
+                || (priority == degraded->control_->priority_.load(std::memory_order_relaxed)
+                    && stream.busy_ > degraded->busy_)) {
+                degraded = &stream;
+            }
+        }
+
+        if (!degraded) {
+            return {};
+        }
+        return { set_tier(*degraded, lower(degraded->control_->tier()), load) };
+    }
+
+    if (load >= config_.recover_load_) {
+        calm_intervals_ = 0;
+        return {};
+    }
+
+    calm_intervals_ += 1;
+    if (calm_intervals_ < config_.recover_intervals_) {
+        return {};
+    }
+    calm_intervals_ = 0;
+
+    // highest priority first, among equals the cheapest stream
+    Stream* restored = nullptr;
+    for (auto& stream : streams_) {
+        auto const& control = *stream.control_;
+        if (control.tier() == QualityTier::FULL) {
+            continue;
+        }
+
+        int priority = control.priority_.load(std::memory_order_relaxed);
+        if (!restored || priority > restored->control_->priority_.load(std::memory_order_relaxed)
+            || (priority == restored->control_->priority_.load(std::memory_order_relaxed)
+                && stream.busy_ < restored->busy_)) {
+            restored = &stream;
+        }
+    }
+
+    if (!restored) {
+        return {};
+    }
+    return { set_tier(*restored, higher(restored->control_->tier()), load) };
+}
+
+TierChange Governor::set_tier(Stream& stream, QualityTier tier, double load)
+{
+    auto& control = *stream.control_;
+
+    TierChange change;
+    change.url_ = stream.url_;
+    change.from_ = control.tier();
+    change.to_ = tier;
+    change.load_ = load;
+    change.queue_depth_ = control.queue_depth_.load(std::memory_order_relaxed);
+
+    control.tier_.store(tier, std::memory_order_relaxed);
+    control.tier_changes_.fetch_add(1, std::memory_order_relaxed);
+    return change;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtsp_camera.hpp"
+
+namespace rtspcam {
+
+struct DecoderControl;
+
+struct GovernorConfig {
+    GovernorConfig()
+        : interval_(500)
+        , max_queue_depth_(8)
+        , max_load_(0.8)
+        , recover_load_(0.6)
+        , recover_intervals_(4)
+    {
+    }
+
+    // How often decode queues and decode times are sampled. One stream changes tier per sample.
+    std::chrono::milliseconds interval_;
+    // A decoder with more packets waiting than this is falling behind.
+    size_t max_queue_depth_;
+    // The host is overloaded when decoding keeps this share of all cores busy.
+    double max_load_;
+    // Streams recover one by one after the load stayed below this for `recover_intervals_`
+    // samples in a row.
+    double recover_load_;
+    int recover_intervals_;
+};
+
+struct TierChange {
+    std::string url_;
+    QualityTier from_;
+    QualityTier to_;
+    // decode load of all streams as a share of all cores, and the stream's queue depth
+    double load_;
+    size_t queue_depth_;
+};
+
+using TierCallback = std::function<void(TierChange const& change)>;
+
+// Keeps an overloaded host responsive by lowering the decoding quality of streams, lowest
+// priority first, one tier at a time (see `QualityTier`). Streams step back up once the load has
+// been low for a while. Off until enabled, a single instance watches all streams of the process.
+class Governor {
+public:
+    static Governor& instance();
+    ~Governor();
+
+    Governor(Governor const&) = delete;
+    Governor& operator=(Governor const&) = delete;
+
+    void enable(GovernorConfig const& config = {});
+    // Stops watching and brings every stream back to full quality.
+    void disable();
+    // Called on the governor's thread for every tier change.
+    void on_change(TierCallback callback);
+
+    // Called by sessions.
+    void add(DecoderControl& control, std::string const& url);
+    void remove(DecoderControl& control);
+
+private:
+    Governor();
+
+    struct Stream {
+        DecoderControl* control_;
+        std::string url_;
+        uint64_t last_decode_time_;
+        double busy_;
+    };
+
+    void run();
+    std::vector<TierChange> sample(std::chrono::microseconds elapsed);
+    TierChange set_tier(Stream& stream, QualityTier tier, double load);
+
+    std::mutex mutex_;
+    std::condition_variable condvar_;
+    GovernorConfig config_;
+    std::vector<Stream> streams_;
+    std::shared_ptr<TierCallback const> callback_;
+    int calm_intervals_;
+    bool is_enabled_;
+    std::thread thread_;
+};
+
+} // namespace rtspcam
@@ -17,14 +17,13 @@ void Image::save(std::string const& filename) const
         throw std::runtime_error("Failed to save image");
     }
 
-    // FIXME(bostjan)
-    int wrap = width_ * 3;
+    int num_channels = channels();
 
-    os << "P6\n"
+    os << (num_channels == 1 ? "P5\n" : "P6\n")
        << width_ << " " << height_ << "\n"
        << 255 << "\n";
 
     for (size_t i = 0; i < height_; i++) {
-        os.write(reinterpret_cast<char const*>(data_ + i * wrap), (int64_t)width_ * 3);
+        os.write(reinterpret_cast<char const*>(data_ + i * stride_), (int64_t)width_ * num_channels);
     }
 }
@@ -6,25 +6,63 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace rtspcam {
 
+struct Rect {
+    Rect(int x, int y, int width, int height)
+        : x_(x)
+        , y_(y)
+        , width_(width)
+        , height_(height)
+    {
+    }
+
+    bool operator==(Rect const& other) const
+    {
+        return x_ == other.x_ && y_ == other.y_ && width_ == other.width_ && height_ == other.height_;
+    }
+    bool operator!=(Rect const& other) const { return !(*this == other); }
+
+    int x_;
+    int y_;
+    int width_;
+    int height_;
+};
+
+enum class ImageFormat {
+    RGB,
+    BGR,
+    GRAY,
+};
+
 struct Image {
-    Image(uint8_t* data, size_t size, uint64_t frame_index, int width, int height, int stride)
+    Image(uint8_t* data, size_t size, uint64_t frame_index, int width, int height, int stride,
+        ImageFormat format, std::shared_ptr<void> owner = {})
         : data_(data)
         , size_(size)
         , frame_index_(frame_index)
         , width_(width)
         , height_(height)
         , stride_(stride)
+        , format_(format)
+        , owner_(std::move(owner))
+        , skipped_(0)
+        , timestamp_(-1)
+        , is_corrupt_(false)
+        , is_shared_(false)
     {
     }
 
     void save(std::string const& filename) const;
+    int channels() const { return format_ == ImageFormat::GRAY ? 1 : 3; }
 
     uint8_t* data_;
     size_t size_;
@@ -32,11 +70,79 @@ struct Image {
     int width_;
     int height_;
     int stride_;
+    ImageFormat format_;
+    // Keeps `data_` alive for as long as the image (or a copy of it) exists. Pooled buffers go
+    // back to their pool once the last image referencing them is gone.
+    std::shared_ptr<void> owner_;
+    // Number of frames the reader missed since its previous image, from the gap in frame indices
+    // less the frames its rate limit dropped.
+    uint64_t skipped_;
+    // Presentation time of the source frame in microseconds since the epoch, -1 if unknown.
+    int64_t timestamp_;
+    // The decoder reported errors, or the frame refers to one decoded after packet loss.
+    bool is_corrupt_;
+    // The pixels are not the image's own: they are the decoder's frame, which later frames are
+    // predicted from, or are handed out as other images of the same read too. Must not be written.
+    bool is_shared_;
 };
 
-enum class ImageFormat {
-    RGB,
-    BGR,
+// A decoded frame in the decoder's own pixel format, e.g. "yuv420p" or "nv12". Plane `i` holds
+// `rows_[i]` rows of `row_size_[i]` bytes, `stride_[i]` bytes apart.
+struct RawFrame {
+    RawFrame()
+        : data_ {}
+        , stride_ {}
+        , row_size_ {}
+        , rows_ {}
+        , num_planes_(0)
+        , width_(0)
+        , height_(0)
+        , frame_index_(0)
+        , timestamp_(-1)
+        , skipped_(0)
+        , is_corrupt_(false)
+    {
+    }
+
+    std::array<uint8_t*, 4> data_;
+    std::array<int, 4> stride_;
+    std::array<int, 4> row_size_;
+    std::array<int, 4> rows_;
+    int num_planes_;
+    int width_;
+    int height_;
+    std::string pixel_format_;
+    uint64_t frame_index_;
+    int64_t timestamp_;
+    uint64_t skipped_;
+    // See `Image::is_corrupt_`.
+    bool is_corrupt_;
+    // Reference to the decoder's buffers.
+    std::shared_ptr<void> owner_;
+};
+
+// Describes one rendition of a camera's stream. 0x0 keeps the size of the (cropped) frame.
+struct OutputSpec {
+    OutputSpec(int width = 0, int height = 0, ImageFormat format = ImageFormat::RGB,
+        std::optional<Rect> roi = {})
+        : width_(width)
+        , height_(height)
+        , format_(format)
+        , roi_(roi)
+    {
+    }
+
+    bool operator==(OutputSpec const& other) const
+    {
+        return width_ == other.width_ && height_ == other.height_ && format_ == other.format_
+            && roi_ == other.roi_;
+    }
+    bool operator!=(OutputSpec const& other) const { return !(*this == other); }
+
+    int width_;
+    int height_;
+    ImageFormat format_;
+    std::optional<Rect> roi_;
 };
 
 } // namespace rtspcam
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace rtspcam {
+
+// What a NAL unit means to a decoder that may skip some of them.
+enum class NalKind {
+    // SPS, PPS and the like, needed to decode anything that follows
+    PARAMETER_SET,
+    // slice of an IDR picture, decodable on its own
+    KEYFRAME,
+    // slice of a picture that refers to other pictures
+    FRAME,
+    // SEI, delimiters and anything else the picture doesn't depend on
+    OTHER,
+};
+
+// nal_unit_type values of ITU-T H.264 table 7-1
+enum H264NalType : uint8_t {
+    H264_NAL_SLICE = 1,
+    H264_NAL_IDR_SLICE = 5,
+    H264_NAL_SEI = 6,
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9,
+};
+
+// `header` is the first byte of the unit, right after its start code.
+inline uint8_t h264_nal_type(uint8_t header)
+{
+    return header & 0x1f;
+}
+
+inline NalKind classify_h264_nal(uint8_t header)
+{
+    switch (h264_nal_type(header)) {
+    case H264_NAL_SPS:
+    case H264_NAL_PPS:
+        return NalKind::PARAMETER_SET;
+    case H264_NAL_IDR_SLICE:
+        return NalKind::KEYFRAME;
+    case H264_NAL_SLICE:
+    case 2: // data partitions A to C
+    case 3:
+    case 4:
+        return NalKind::FRAME;
+    default:
+        return NalKind::OTHER;
+    }
+}
+
+// An access unit delimiter, ends the access unit in front of it for the parser.
+inline constexpr uint8_t h264_access_unit_delimiter[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+
+// nal_unit_type values of ITU-T H.265 table 7-1
+enum H265NalType : uint8_t {
+    H265_NAL_BLA_W_LP = 16,
+    H265_NAL_IDR_W_RADL = 19,
+    H265_NAL_IDR_N_LP = 20,
+    H265_NAL_CRA = 21,
+    H265_NAL_VPS = 32,
+    H265_NAL_SPS = 33,
+    H265_NAL_PPS = 34,
+    H265_NAL_AUD = 35,
+};
+
+// `header` is the first of the two header bytes.
+inline uint8_t h265_nal_type(uint8_t header)
+{
+    return (header >> 1) & 0x3f;
+}
+
+inline NalKind classify_h265_nal(uint8_t header)
+{
+    uint8_t type = h265_nal_type(header);
+    switch (type) {
+    case H265_NAL_VPS:
+    case H265_NAL_SPS:
+    case H265_NAL_PPS:
+        return NalKind::PARAMETER_SET;
+    default:
+        break;
+    }
+    // BLA, IDR and CRA pictures (IRAP), decoding can start at any of them
+    if (type >= H265_NAL_BLA_W_LP && type <= H265_NAL_CRA) {
+        return NalKind::KEYFRAME;
+    }
+    if (type < H265_NAL_BLA_W_LP) {
+        return NalKind::FRAME;
+    }
+    return NalKind::OTHER;
+}
+
+// pic_type 2, any kind of slice may follow
+inline constexpr uint8_t h265_access_unit_delimiter[] = { 0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50 };
+
+// The codecs of the video subsessions that are decoded.
+enum class VideoCodec {
+    H264,
+    H265,
+};
+
+inline NalKind classify_nal(VideoCodec codec, uint8_t header)
+{
+    return codec == VideoCodec::H265 ? classify_h265_nal(header) : classify_h264_nal(header);
+}
+
+} // namespace rtspcam
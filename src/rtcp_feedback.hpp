@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace rtspcam {
+
+inline void put_u32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+// A compound RTCP packet asking the sender of `media_ssrc` for a keyframe. It holds an empty
+// receiver report, which has to come first, and the SDES CNAME every compound packet must carry
+// (RFC 3550), then a Picture Loss Indication (RFC 4585) and a Full Intra Request (RFC 5104), since
+// cameras tend to honour only one of the two. `sequence` tells repeated FIRs from new ones and must
+// change with every request. `cname` is the session's canonical name, cut to the 255 bytes an SDES
+// item holds.
+inline std::vector<uint8_t> make_keyframe_request(uint32_t sender_ssrc, uint32_t media_ssrc,
+    uint8_t sequence, std::string_view cname)
+{
+    cname = cname.substr(0, 255);
+    // the CNAME item is followed by at least one null octet, up to the next 32-bit boundary
+    size_t const sdes_size = 8 + (2 + cname.size() + 4) / 4 * 4;
+
+    std::vector<uint8_t> packet(8 + sdes_size + 12 + 20);
+    uint8_t* p = packet.data();
+
+    // receiver report without report blocks: V=2, RC=0, PT=201, length 1
+    p[0] = 0x80;
+    p[1] = 201;
+    p[3] = 1;
+    put_u32(p + 4, sender_ssrc);
+    p += 8;
+
+    // source description with one chunk: V=2, SC=1, PT=202, CNAME item
+    p[0] = 0x81;
+    p[1] = 202;
+    p[3] = (uint8_t)(sdes_size / 4 - 1);
+    put_u32(p + 4, sender_ssrc);
+    p[8] = 1;
+    p[9] = (uint8_t)cname.size();
+    std::copy(cname.begin(), cname.end(), p + 10);
+    p += sdes_size;
+
+    // payload-specific feedback, PLI: V=2, FMT=1, PT=206, length 2
+    p[0] = 0x81;
+    p[1] = 206;
+    p[3] = 2;
+    put_u32(p + 4, sender_ssrc);
+    put_u32(p + 8, media_ssrc);
+    p += 12;
+
+    // payload-specific feedback, FIR: V=2, FMT=4, PT=206, length 4, media source unused (0)
+    p[0] = 0x84;
+    p[1] = 206;
+    p[3] = 4;
+    put_u32(p + 4, sender_ssrc);
+    put_u32(p + 12, media_ssrc);
+    p[16] = sequence;
+
+    return packet;
+}
+
+} // namespace rtspcam
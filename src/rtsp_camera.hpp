@@ -6,20 +6,329 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include "image.hpp"
+#include "tensor.hpp"
 
 namespace rtspcam {
 
+// Selects where frame callbacks run and what happens when a callback can't keep up.
+enum class Backpressure {
+    // Runs on the decoder thread. Every decoded frame is delivered and a slow callback stalls
+    // decoding.
+    BLOCK,
+    // Runs on the conversion thread. Frames decoded while the callback is busy are dropped and
+    // the newest one is delivered next.
+    LATEST,
+};
+
+// Describes the frame `RtspCamera::read_into` wrote.
+struct FrameSlot {
+    FrameSlot()
+        : frame_index_(0)
+        , timestamp_(-1)
+        , is_stale_(true)
+        , is_missing_(true)
+    {
+    }
+
+    uint64_t frame_index_;
+    // Presentation time in microseconds since the epoch, -1 if unknown.
+    int64_t timestamp_;
+    // No frame was decoded since the previous call, the last one was converted again.
+    bool is_stale_;
+    // No frame was decoded yet or the stream failed, the buffer was zeroed.
+    bool is_missing_;
+};
+
+enum class DeliveryMode {
+    // Only the newest frame is kept for the reader.
+    LATEST,
+    // Up to `Delivery::queue_size_` frames are kept in order. When full, the oldest one is dropped
+    // or, with `Delivery::block_`, the decoder waits for the reader.
+    QUEUE,
+};
+
+// How decoded frames reach a reader that doesn't keep up with the stream.
+struct Delivery {
+    Delivery(DeliveryMode mode = DeliveryMode::LATEST, size_t queue_size = 1, bool block = false)
+        : mode_(mode)
+        , queue_size_(queue_size)
+        , block_(block)
+    {
+    }
+
+    DeliveryMode mode_;
+    size_t queue_size_;
+    // Never drop a frame. A reader that falls behind stalls decoding for every reader of the
+    // stream, while received data keeps queueing up in front of the decoder.
+    bool block_;
+};
+
+// Decoding shortcuts the governor takes for an overloaded host, each tier includes the ones
+// before it. See `Governor`.
+enum class QualityTier {
+    FULL,
+    // deblocking skipped, slightly blocky images
+    NO_LOOP_FILTER,
+    // non-reference frames discarded by the decoder
+    DROP_NONREF,
+    // keyframes only
+    KEYFRAMES_ONLY,
+};
+
+// What becomes of the rest of a GOP after RTP packets went missing. Frames decoded from it
+// refer to pictures missing slices.
+enum class LossPolicy {
+    // decoded and marked with `Image::is_corrupt_`
+    CONCEAL,
+    // dropped before decoding, the stream resumes at the next keyframe
+    SKIP_TO_KEYFRAME,
+};
+
+// Microseconds from sending RTSP DESCRIBE to each step of starting a stream, -1 until it is reached.
+struct StartupTimes {
+    StartupTimes()
+        : described_(-1)
+        , playing_(-1)
+        , first_packet_(-1)
+        , first_keyframe_(-1)
+        , first_frame_(-1)
+        , first_read_(-1)
+    {
+    }
+
+    // session description received
+    int64_t described_;
+    // PLAY acknowledged
+    int64_t playing_;
+    int64_t first_packet_;
+    // first IDR slice passed to the decoder
+    int64_t first_keyframe_;
+    int64_t first_frame_;
+    // first image returned to this reader
+    int64_t first_read_;
+};
+
+// How a stream comes back after the camera or the network failed. Attempts are spaced by a delay
+// that doubles from `initial_delay_` up to `max_delay_`, of which a random half is waited, so that
+// cameras that failed together don't reconnect together.
+struct ReconnectPolicy {
+    ReconnectPolicy()
+        : initial_delay_(500)
+        , max_delay_(30'000)
+        , max_attempts_(0)
+        , stall_timeout_(5'000)
+    {
+    }
+
+    std::chrono::milliseconds initial_delay_;
+    std::chrono::milliseconds max_delay_;
+    // Failed attempts in a row before the stream fails for good, 0 retries forever.
+    int max_attempts_;
+    // A playing stream without data for this long has failed, zero waits forever.
+    std::chrono::milliseconds stall_timeout_;
+};
+
+// How `RtspCamera::open_all` starts a fleet of streams.
+struct OpenOptions {
+    OpenOptions()
+        : max_handshakes_(32)
+    {
+    }
+
+    // RTSP handshakes in flight at a time, the other streams wait for one to finish. 0 starts all
+    // of them at once. A camera that doesn't get to PLAY within 10 s fails, or reconnects, and
+    // frees its turn.
+    size_t max_handshakes_;
+};
+
+// Counters of a reader and of the stream it reads, since the camera was opened.
+struct CameraStats {
+    CameraStats()
+        : frames_decoded_(0)
+        , frames_delivered_(0)
+        , frames_skipped_(0)
+        , frames_decimated_(0)
+        , packets_decoded_(0)
+        , units_discarded_(0)
+        , quality_tier_(QualityTier::FULL)
+        , tier_changes_(0)
+        , decode_queue_depth_(0)
+        , is_suspended_(false)
+        , suspends_(0)
+        , resume_latency_(-1)
+        , packets_lost_(0)
+        , keyframe_requests_(0)
+        , keyframe_recovery_(-1)
+        , is_reconnecting_(false)
+        , reconnects_(0)
+        , reconnect_attempts_(0)
+        , gaps_(0)
+        , frames_concealed_(0)
+        , decode_errors_(0)
+        , callback_errors_(0)
+    {
+    }
+
+    // Frames decoded from the stream, shared by all readers of it.
+    uint64_t frames_decoded_;
+    // Frames handed to this reader by `read`, `read_outputs`, `read_raw` or callbacks.
+    uint64_t frames_delivered_;
+    // Decoded frames this reader never got.
+    uint64_t frames_skipped_;
+    // Decoded frames dropped by this reader's rate limit, not counted as skipped.
+    uint64_t frames_decimated_;
+    // Packets fed to the decoder. More than `frames_decoded_` when the decoder discards frames.
+    uint64_t packets_decoded_;
+    // NAL units of the stream dropped before decoding, e.g. in keyframe-only mode.
+    uint64_t units_discarded_;
+    // Tier the governor currently holds the stream at, and how often it changed it.
+    QualityTier quality_tier_;
+    uint64_t tier_changes_;
+    // Packets waiting for the decoder.
+    size_t decode_queue_depth_;
+    // Whether the stream is paused for being idle, and how often it was.
+    bool is_suspended_;
+    uint64_t suspends_;
+    // Microseconds from the last request to resume to the first frame decoded after it, -1 if the
+    // stream never resumed.
+    int64_t resume_latency_;
+    StartupTimes startup_;
+    // RTP packets that never arrived.
+    uint64_t packets_lost_;
+    // Keyframes asked for over RTCP after losses, decoding errors or when joining the stream.
+    uint64_t keyframe_requests_;
+    // Microseconds from the last answered request to its keyframe, -1 if none was answered.
+    int64_t keyframe_recovery_;
+    // Whether the stream failed and is being reconnected, reconnects that brought data again and
+    // attempts made since the last success.
+    bool is_reconnecting_;
+    uint64_t reconnects_;
+    int reconnect_attempts_;
+    // Times RTP packets went missing and frames decoded corrupt, see `LossPolicy`.
+    uint64_t gaps_;
+    uint64_t frames_concealed_;
+    // Packets the decoder failed on, see `set_error_budget`.
+    uint64_t decode_errors_;
+    // Exceptions thrown by this reader's frame callback, see `on_frame`.
+    uint64_t callback_errors_;
+};
+
+using FrameCallback = std::function<void(Image const& image)>;
+using ErrorCallback = std::function<void(std::string const& error)>;
+using ReadyCallback = std::function<void()>;
+
 class RtspCamera {
 public:
     static std::unique_ptr<RtspCamera> open(std::string const& url);
+    // Opens a camera for each of `urls` without waiting for any of them, in the same order. The
+    // streams share a pool of event loop threads, one per core, instead of a thread each. See
+    // `started` for when a camera has its first frame.
+    static std::vector<std::unique_ptr<RtspCamera>> open_all(std::vector<std::string> const& urls,
+        OpenOptions const& options = {});
     virtual ~RtspCamera() = default;
+    // Becomes ready once this reader got its first frame, or holds the error that ended the
+    // stream before that. Decoders start with the first keyframe of their stream.
+    virtual std::shared_future<void> started() = 0;
     virtual Image read() = 0;
+    // Waits for the next frame without handing it on, the next read of any kind gets it. Returns
+    // what `read` will make of it without converting it: geometry, format and frame index, no
+    // pixels. Lets a caller size the buffer for `read_tensor`. In pipelined mode the converted
+    // image is returned and the next `read` or `read_tensor` gets it.
+    virtual Image peek() = 0;
+    // Returns another reader of the same stream. The RTSP session and the decoder are shared, every
+    // reader gets every frame by reference and has its own settings, callbacks and `delivery`.
+    // What the decoder leaves out (luma-only decoding for GRAY, non-reference frames, all but
+    // keyframes) is what every current reader lets it leave out. A reader lets chroma go only
+    // while its image format, its outputs and its batch specs are all GRAY.
+    virtual std::unique_ptr<RtspCamera> subscribe(Delivery const& delivery = {}) = 0;
+    // Returns number of decoded frames this reader never got, because it didn't keep up.
+    virtual uint64_t skipped_frames() = 0;
+    virtual CameraStats stats() = 0;
+    // Reads the next decoded frame as is, in the decoder's pixel format. No conversion and no
+    // copy, the planes are shared with the decoder. Not available in pipelined mode.
+    virtual RawFrame read_raw() = 0;
+    // Selects how decoded frames are kept for this reader, latest only by default. Frames already
+    // waiting beyond a smaller queue are dropped.
+    virtual void set_delivery(Delivery const& delivery) = 0;
+    // Limits this reader to `fps` frames per second of stream time, 0 removes the limit. Frames
+    // that aren't due are dropped before they are queued or converted and don't count as skipped,
+    // delivered frames keep their stream frame indices. With `drop_nonref` the decoder also
+    // discards non-reference frames, while every reader of the stream asks for it.
+    virtual void set_max_rate(double fps, bool drop_nonref = false) = 0;
+    // Decodes IDR pictures only, roughly one image per GOP. Everything else is dropped as it
+    // arrives, before it is copied. Turning it off resumes at the next keyframe. Like luma-only
+    // decoding it is in effect while every reader of the stream asks for it.
+    virtual void set_keyframes_only(bool keyframes_only) = 0;
+    // Orders streams for the governor, lower priorities are degraded first and recover last.
+    // Shared by all readers of the stream, 0 by default.
+    virtual void set_priority(int priority) = 0;
+    // Pauses the stream with RTSP PAUSE after none of its readers read for `timeout`, zero (the
+    // default) keeps it playing. The decoder drops its frames until the next read sends PLAY,
+    // which returns once a keyframe was decoded. Readers with a frame callback keep the stream
+    // playing. Shared by all readers of the stream.
+    virtual void set_idle_timeout(std::chrono::milliseconds timeout) = 0;
+    // Reconnects a failed stream according to `policy` instead of ending it, `std::nullopt` (the
+    // default) ends it on the first failure. Reads wait while reconnecting, `stats` tells whether
+    // the stream is. The decoder and the buffers of all readers are kept, and the first attempt
+    // reuses the session description of the failed session. Shared by all readers of the stream.
+    virtual void set_reconnect(std::optional<ReconnectPolicy> const& policy) = 0;
+    // Selects what happens to frames after packet loss, concealed by default. Shared by all
+    // readers of the stream.
+    virtual void set_loss_policy(LossPolicy policy) = 0;
+    // Decoding starts over at the next keyframe after an error. More than `errors` in a row put
+    // the camera in the error state, 0 never does. 100 by default, shared by all readers.
+    virtual void set_error_budget(int errors) = 0;
+    // Delivers every image to `callback` instead of `read`, from the camera's own threads. An empty
+    // callback goes back to polling, a callback that was running has returned by then. Exceptions
+    // thrown by the callback are logged and counted, the reader keeps getting frames.
+    virtual void on_frame(FrameCallback callback, Backpressure backpressure = Backpressure::LATEST) = 0;
+    // Reports the error that ends the stream, from the thread that detected it.
+    virtual void on_error(ErrorCallback callback) = 0;
+    // Returns whether `read` has a new image or an error to report and would not wait for the
+    // stream.
+    virtual bool is_ready() = 0;
+    // Calls `callback` whenever the camera may have become ready, from the camera's own threads.
+    // It must be cheap and must not call back into the camera. Used by `CameraSet`.
+    virtual void set_ready_callback(ReadyCallback callback) = 0;
+    // Reads the next image and writes it to `buffer` as a normalized tensor of `format`. Geometry
+    // and channel order follow `set_size` and `set_image_format`. 4:2:0 frames are resized,
+    // converted, reordered and normalized in a single pass, without an intermediate image.
+    // Returns the image the tensor was computed from, without pixels after a single pass.
+    virtual Image read_tensor(void* buffer, size_t size, TensorFormat const& format) = 0;
+    // Converts the newest decoded frame to `spec` straight into `buffer`, which holds
+    // `spec.height_` rows of `stride` bytes. Never waits for the stream and never throws on a
+    // failed stream. Meant for batching, don't mix with `read` on the same camera.
+    virtual FrameSlot read_into(uint8_t* buffer, int stride, OutputSpec const& spec) = 0;
+    // Reads the next image and converts it to every output added with `add_output`.
+    virtual std::map<std::string, Image> read_outputs() = 0;
     virtual void set_image_format(ImageFormat format) = 0;
     virtual void set_size(int width, int height) = 0;
+    // Number of threads converting each frame in horizontal slices. 1 (default) converts on the
+    // thread calling `read`, 0 uses one thread per core.
+    virtual void set_conversion_threads(int num_threads) = 0;
+    // Converts frames on a dedicated thread as soon as they are decoded, so `read` only hands
+    // over the newest converted image. Conversion pauses while nobody reads.
+    virtual void set_pipelined(bool pipelined) = 0;
+    // Crops images returned by `read` to `roi` before they are converted, so only the pixels
+    // inside of it are touched. The corner is snapped to the chroma grid of the stream. Can be
+    // changed at any time, `std::nullopt` restores full frames.
+    virtual void set_roi(std::optional<Rect> const& roi) = 0;
+    // Adds or replaces a named output returned by `read_outputs`. All outputs are converted from
+    // the same decoded frame, each with its own scaler. Can be changed at any time.
+    virtual void add_output(std::string const& name, OutputSpec const& spec) = 0;
+    virtual void remove_output(std::string const& name) = 0;
+    // Moves the region of interest of a named output, adding one at native size if needed.
+    virtual void set_roi(std::string const& name, Rect const& roi) = 0;
 };
 
 } // namespace rtspcam
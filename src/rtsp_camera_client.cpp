@@ -4,10 +4,13 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -17,13 +20,16 @@
 #include <liveMedia.hh>
 
 #include "decoder.hpp"
+#include "nal_unit.hpp"
+#include "rtcp_feedback.hpp"
 #include "rtsp_camera_client.hpp"
 #include "video_frame.hpp"
 
 using namespace rtspcam;
 
-static void on_quit_event(void* data);
 static std::vector<uint8_t> decode_sprop_parameters(char const* sprop_parameters);
+static std::optional<VideoCodec> video_codec(MediaSubsession const& subsession);
+static std::string with_credentials(std::string const& url, std::string const& credentials_url);
 
 static void subsessionAfterPlaying(void* client_data);
 static void subsessionByeHandler(void* client_data, char const* reason);
@@ -35,21 +41,34 @@ static UsageEnvironment& operator<<(UsageEnvironment& env, MediaSubsession const
 
 static constexpr size_t receive_buffer_size = 2'000'000;
 static constexpr bool be_verbose = false;
+// how often a playing stream is checked for being idle, in microseconds
+static constexpr int64_t idle_check_interval = 250'000;
+// a camera that doesn't get to PLAY in this many microseconds is given up on
+static constexpr int64_t handshake_timeout = 10'000'000;
+// unanswered keyframe requests are repeated after this many microseconds
+static constexpr int64_t keyframe_request_interval = 1'000'000;
 
 class VideoSink : public MediaSink {
 public:
     static VideoSink* create(
         UsageEnvironment& env,
         MediaSubsession& subsession, // identifies the kind of data that's being received
-        Swapper<VideoFramePtr>& swapper,
-        Slice extradata,
+        Decoder& decoder,
+        DecoderControl& decoder_control,
+        VideoCodec codec,
         char const* stream_id = nullptr); // identifies the stream itself (optional)
 
+    // Drops incoming data and frees the decoder's frames while the stream is paused. Decoding
+    // resumes at the next keyframe.
+    void suspend();
+    void resume();
+
 private:
     VideoSink(UsageEnvironment& env,
         MediaSubsession& subsession,
-        Swapper<VideoFramePtr>& swapper,
-        Slice extradata,
+        Decoder& decoder,
+        DecoderControl& decoder_control,
+        VideoCodec codec,
         char const* stream_id);
 
     static void afterGettingFrame(void* clientData,
@@ -64,65 +83,206 @@ private:
         unsigned durationInMicroseconds);
 
     virtual Boolean continuePlaying() override;
+    bool should_decode(uint8_t header, int64_t pts);
+    void check_packet_loss();
+    void maybe_request_keyframe();
+    void on_keyframe();
 
     MediaSubsession& subsession_;
     std::vector<uint8_t> receive_buffer_;
     std::string stream_id_;
-    bool waiting_for_sps_unit_;
-    Decoder decoder_;
+    DecoderControl& decoder_control_;
+    VideoCodec codec_;
+    // Keyframe-only filtering, also while waiting for a keyframe at the start, after a pause or
+    // after the mode was turned off. Parameter sets always pass.
+    bool skipping_to_keyframe_;
+    std::optional<int64_t> open_keyframe_pts_;
+    // Packets went missing since the last keyframe, the pictures until the next one are damaged.
+    bool is_chain_broken_;
+    bool is_suspended_;
+    // RTCP keyframe requests, times from the steady clock in microseconds
+    bool keyframe_due_;
+    std::optional<int64_t> keyframe_requested_;
+    int64_t last_keyframe_request_;
+    uint8_t fir_sequence_;
+    uint64_t packets_lost_;
+    // owned by the client, outlives the sinks of all sessions
+    Decoder& decoder_;
 };
 
 std::unique_ptr<RtspCameraClient, RtspCameraClient::Deleter> RtspCameraClient::create(
-    UsageEnvironment& environment,
+    EventLoop& loop,
     std::string const& rtsp_url,
-    Swapper<VideoFramePtr>& swapper,
-    ErrorSlot& error_slot)
+    FrameChannel& channel,
+    ErrorSlot& error_slot,
+    DecoderControl& decoder_control)
 {
     return std::unique_ptr<RtspCameraClient, RtspCameraClient::Deleter>(
-        new RtspCameraClient(environment, rtsp_url, swapper, error_slot),
+        new RtspCameraClient(loop, rtsp_url, channel, error_slot, decoder_control),
         RtspCameraClient::Deleter());
 }
 
 static constexpr int verbosity_level = 0;
 
-RtspCameraClient::RtspCameraClient(UsageEnvironment& environment,
+RtspCameraClient::RtspCameraClient(EventLoop& loop,
     std::string const& rtsp_url,
-    Swapper<VideoFramePtr>& swapper,
-    ErrorSlot& error_slot)
-    : RTSPClient(environment, rtsp_url.c_str(), verbosity_level, "rtspcam", 0, -1)
-    , swapper_(swapper)
+    FrameChannel& channel,
+    ErrorSlot& error_slot,
+    DecoderControl& decoder_control)
+    : RTSPClient(loop.environment(), rtsp_url.c_str(), verbosity_level, "rtspcam", 0, -1)
+    , loop_(loop)
+    , channel_(channel)
     , error_slot_(error_slot)
-    , quit_flag_(0)
+    , decoder_control_(decoder_control)
     , already_shutteddown_(false)
+    , is_quitting_(false)
     , stream_state_ {}
+    , handshake_timeout_task_(nullptr)
+    , codec_(VideoCodec::H264)
+    , rtsp_url_(rtsp_url)
+    , stall_timeout_(0)
+    , random_(std::random_device {}())
+    , reconnect_task_(nullptr)
+    , playing_since_(0)
+    , is_reconnecting_(false)
+    , reconnects_(0)
+    , reconnect_attempts_(0)
+    , idle_check_task_(nullptr)
+    , idle_timeout_(0)
+    , last_activity_(steady_time_us())
+    , awake_holds_(0)
+    , is_suspended_(false)
+    , is_resume_posted_(false)
+    , suspends_(0)
 {
-    quit_trigger_ = envir().taskScheduler().createEventTrigger(on_quit_event);
-    sendDescribeCommand(continueAfterDESCRIBE);
-
-    thread_ = std::thread([&env = envir(), quit_flag = &quit_flag_] {
-        // env->taskScheduler().scheduleDelayedTask(1'000'000, task, nullptr);
-        env.taskScheduler().doEventLoop(quit_flag);
-    });
 }
 
 RtspCameraClient::~RtspCameraClient() { }
 
-void RtspCameraClient::quit()
+void RtspCameraClient::start(std::function<void()> on_started)
+{
+    on_started_ = std::move(on_started);
+    DecoderControl::mark(decoder_control_.describe_sent_);
+    schedule_handshake_timeout();
+    sendDescribeCommand(continueAfterDESCRIBE);
+}
+
+void RtspCameraClient::schedule_handshake_timeout()
 {
-    envir().taskScheduler().triggerEvent(quit_trigger_, this);
-    thread_.join();
+    envir().taskScheduler().unscheduleDelayedTask(handshake_timeout_task_);
+    handshake_timeout_task_ = envir().taskScheduler().scheduleDelayedTask(handshake_timeout,
+        (TaskFunc*)handshakeTimeoutHandler, this);
 }
 
 void RtspCameraClient::on_quit()
 {
+    is_quitting_ = true;
+    envir().taskScheduler().unscheduleDelayedTask(reconnect_task_);
     shutdownStream(this);
-    quit_flag_ = 1;
+}
+
+void RtspCameraClient::handshake_done()
+{
+    if (on_started_) {
+        auto on_started = std::move(on_started_);
+        on_started_ = nullptr;
+        on_started();
+    }
+}
+
+void RtspCameraClient::set_idle_timeout(std::chrono::milliseconds timeout)
+{
+    idle_timeout_.store(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count(),
+        std::memory_order_relaxed);
+}
+
+void RtspCameraClient::touch()
+{
+    int64_t now = steady_time_us();
+    last_activity_.store(now, std::memory_order_relaxed);
+
+    if (is_suspended_.load(std::memory_order_relaxed)) {
+        // the first reader to notice starts the clock, the decoder stops it
+        int64_t not_started = 0;
+        decoder_control_.resume_started_.compare_exchange_strong(not_started, now,
+            std::memory_order_relaxed);
+        // readers keep touching until the stream plays, one resume at a time is enough
+        if (!is_resume_posted_.exchange(true, std::memory_order_relaxed)) {
+            loop_.post([this]() {
+                is_resume_posted_.store(false, std::memory_order_relaxed);
+                on_resume();
+            });
+        }
+    }
+}
+
+void RtspCameraClient::hold_awake(bool hold)
+{
+    awake_holds_.fetch_add(hold ? 1 : -1, std::memory_order_relaxed);
+    if (hold) {
+        touch();
+    }
+}
+
+void RtspCameraClient::suspend()
+{
+    UsageEnvironment& env = envir();
+    StreamState& state = stream_state_;
+
+    env << *this << "Pausing idle stream\n";
+    is_suspended_.store(true, std::memory_order_relaxed);
+    suspends_.fetch_add(1, std::memory_order_relaxed);
+
+    MediaSubsessionIterator iter(*state.session_);
+    while (MediaSubsession* subsession = iter.next()) {
+        if (subsession->sink != nullptr) {
+            static_cast<VideoSink*>(subsession->sink)->suspend();
+        }
+    }
+
+    sendPauseCommand(*state.session_, continueAfterPAUSE);
+}
+
+void RtspCameraClient::set_reconnect(std::optional<ReconnectPolicy> const& policy)
+{
+    std::scoped_lock lock(reconnect_mutex_);
+    reconnect_policy_ = policy;
+    stall_timeout_.store(policy ? std::chrono::duration_cast<std::chrono::microseconds>(policy->stall_timeout_).count() : 0,
+        std::memory_order_relaxed);
+}
+
+void RtspCameraClient::on_resume()
+{
+    StreamState& state = stream_state_;
+    if (!is_suspended_.load(std::memory_order_relaxed) || already_shutteddown_) {
+        return;
+    }
+
+    envir() << *this << "Resuming stream\n";
+    is_suspended_.store(false, std::memory_order_relaxed);
+    playing_since_ = steady_time_us();
+    last_activity_.store(playing_since_, std::memory_order_relaxed);
+
+    MediaSubsessionIterator iter(*state.session_);
+    while (MediaSubsession* subsession = iter.next()) {
+        if (subsession->sink != nullptr) {
+            static_cast<VideoSink*>(subsession->sink)->resume();
+        }
+    }
+
+    sendPlayCommand(*state.session_, continueAfterRESUME);
 }
 
 // RtspCameraClient::StreamState::StreamState() {}
 RtspCameraClient::StreamState::~StreamState()
+{
+    close();
+}
+
+void RtspCameraClient::StreamState::close()
 {
     delete subsession_iterator_;
+    subsession_iterator_ = nullptr;
     if (session_ != NULL) {
         // We also need to delete "session", and unschedule "streamTimerTask" (if set)
         UsageEnvironment& env = session_->envir();
@@ -130,15 +290,182 @@ RtspCameraClient::StreamState::~StreamState()
         env.taskScheduler().unscheduleDelayedTask(session_timeout_broken_server_task_);
         env.taskScheduler().unscheduleDelayedTask(stream_timer_task_);
         Medium::close(session_);
+        session_ = nullptr;
     }
+    subsession_ = nullptr;
+    duration_ = 0.0;
 }
 
-static void on_quit_event(void* data)
+void RtspCameraClient::prepare_decoder(VideoCodec codec, std::vector<uint8_t> extradata)
 {
-    auto* self = static_cast<RtspCameraClient*>(data);
-    self->on_quit();
+    if (!decoder_ || codec != codec_) {
+        // the sinks of the previous session are gone, nothing refers to the old decoder
+        decoder_ = std::make_unique<Decoder>(channel_, decoder_control_, error_slot_, codec,
+            Slice { extradata.data(), extradata.size() });
+    } else if (!extradata.empty() && extradata != extradata_) {
+        // the camera came back with other parameter sets, they go in-band ahead of its keyframe
+        decoder_->send({ extradata.data(), extradata.size() }, AV_NOPTS_VALUE);
+    }
+    extradata_ = std::move(extradata);
+    codec_ = codec;
+}
+
+bool RtspCameraClient::start_session(char const* sdp)
+{
+    UsageEnvironment& env = envir();
+    StreamState& state = stream_state_;
+
+    // Create a media session object from this SDP description:
+    state.session_ = MediaSession::createNew(env, sdp);
+    if (state.session_ == nullptr) {
+        env << *this
+            << "Failed to create a MediaSession object from the SDP "
+               "description: "
+            << env.getResultMsg() << "\n";
+        return false;
+    }
+    if (state.session_->hasSubsessions() == False) {
+        env << *this
+            << "This session has no media subsessions (i.e., no \"m=\" "
+               "lines)\n";
+        return false;
+    }
+
+    // Then, create and set up our data source objects for the session.  We
+    // do this by iterating over the session's 'subsessions', calling
+    // "MediaSubsession::initiate()", and then sending a RTSP "SETUP"
+    // command, on each one. (Each 'subsession' will have its own data
+    // source.)
+    state.subsession_iterator_ = new MediaSubsessionIterator(*state.session_);
+    setupNextSubsession(this);
+    return true;
 }
 
+void RtspCameraClient::close_session()
+{
+    UsageEnvironment& env = envir();
+    StreamState& state = stream_state_;
+
+    env.taskScheduler().unscheduleDelayedTask(idle_check_task_);
+    env.taskScheduler().unscheduleDelayedTask(handshake_timeout_task_);
+    // a paused session is gone too, the next one starts playing
+    is_suspended_.store(false, std::memory_order_relaxed);
+
+    // First, check whether any subsessions have still to be closed:
+    if (state.session_ != NULL) {
+        Boolean someSubsessionsWereActive = False;
+        MediaSubsessionIterator iter(*state.session_);
+        MediaSubsession* subsession;
+
+        while ((subsession = iter.next()) != NULL) {
+            if (subsession->sink != NULL) {
+                Medium::close(subsession->sink);
+                subsession->sink = NULL;
+
+                if (subsession->rtcpInstance() != NULL) {
+                    subsession->rtcpInstance()->setByeHandler(
+                        NULL, NULL); // in case the server sends a RTCP "BYE"
+                                     // while handling "TEARDOWN"
+                }
+
+                someSubsessionsWereActive = True;
+            }
+        }
+
+        if (someSubsessionsWereActive == True) {
+            // Send a RTSP "TEARDOWN" command, to tell the server to shutdown
+            // the stream. Don't bother handling the response to the "TEARDOWN".
+            sendTeardownCommand(*state.session_, NULL);
+        }
+
+        // the session itself is deleted when reconnecting or with the client
+        env.taskScheduler().unscheduleDelayedTask(state.session_timeout_broken_server_task_);
+        env.taskScheduler().unscheduleDelayedTask(state.stream_timer_task_);
+    }
+}
+
+bool RtspCameraClient::schedule_reconnect()
+{
+    if (reconnect_task_ != nullptr) {
+        return true;
+    }
+
+    std::optional<ReconnectPolicy> policy;
+    {
+        std::scoped_lock lock(reconnect_mutex_);
+        policy = reconnect_policy_;
+    }
+    int attempts = reconnect_attempts_.load(std::memory_order_relaxed);
+    if (!policy || (policy->max_attempts_ > 0 && attempts >= policy->max_attempts_)) {
+        return false;
+    }
+
+    // doubles with every attempt up to the limit, half of it is random
+    auto initial_delay = std::chrono::duration_cast<std::chrono::microseconds>(policy->initial_delay_);
+    auto max_delay = std::chrono::duration_cast<std::chrono::microseconds>(policy->max_delay_);
+    double delay = std::min((double)max_delay.count(),
+        std::ldexp((double)initial_delay.count(), std::min(attempts, 30)));
+    delay = delay / 2 + std::uniform_real_distribution<double>(0.0, delay / 2)(random_);
+
+    envir() << *this << "Reconnecting in " << (int)(delay / 1000) << " ms\n";
+    is_reconnecting_.store(true, std::memory_order_relaxed);
+    reconnect_attempts_.store(attempts + 1, std::memory_order_relaxed);
+    reconnect_task_ = envir().taskScheduler().scheduleDelayedTask((int64_t)delay,
+        (TaskFunc*)reconnectHandler, this);
+    return true;
+}
+
+void RtspCameraClient::reconnect()
+{
+    UsageEnvironment& env = envir();
+
+    stream_state_.close();
+    // drops the connection, requests still waiting for it and the RTSP session id
+    reset();
+    error_message_.clear();
+    if (decoder_) {
+        decoder_->restart();
+    }
+
+    // The first attempt skips DESCRIBE. A camera that was reconfigured meanwhile fails SETUP or
+    // PLAY and gets described on the next attempt.
+    schedule_handshake_timeout();
+    if (reconnect_attempts_.load(std::memory_order_relaxed) == 1 && !sdp_.empty()) {
+        env << *this << "Reconnecting with the previous session description\n";
+        setBaseURL(base_url_.c_str());
+        if (!start_session(sdp_.c_str())) {
+            shutdownStream(this);
+        }
+        return;
+    }
+
+    env << *this << "Reconnecting\n";
+    setBaseURL(rtsp_url_.c_str());
+    sendDescribeCommand(continueAfterDESCRIBE);
+}
+
+static void rtspcam::reconnectHandler(void* client_data)
+{
+    RtspCameraClient& client = *static_cast<RtspCameraClient*>(client_data);
+    client.reconnect_task_ = nullptr;
+    client.reconnect();
+}
+
+static void rtspcam::handshakeTimeoutHandler(void* client_data)
+{
+    RtspCameraClient& client = *static_cast<RtspCameraClient*>(client_data);
+    client.handshake_timeout_task_ = nullptr;
+
+    std::ostringstream os;
+    os << "No response to the RTSP handshake within " << handshake_timeout / 1000 << " ms";
+    client.error_message_ = os.str();
+    client.envir() << client << client.error_message_.c_str() << "\n";
+    shutdownStream(&client);
+    // a late response must not start the session that was given up on
+    client.reset();
+}
+
+
 static void rtspcam::continueAfterDESCRIBE(RTSPClient* rtsp_client,
     int result_code,
     char* result_string)
@@ -146,7 +473,6 @@ static void rtspcam::continueAfterDESCRIBE(RTSPClient* rtsp_client,
     do {
         UsageEnvironment& env = rtsp_client->envir();
         RtspCameraClient& client = *static_cast<RtspCameraClient*>(rtsp_client);
-        RtspCameraClient::StreamState& state = client.stream_state_;
 
         if (result_code != 0) {
             env << client << "Failed to get a SDP description: " << result_string << "\n";
@@ -157,34 +483,21 @@ static void rtspcam::continueAfterDESCRIBE(RTSPClient* rtsp_client,
             break;
         }
 
+        DecoderControl::mark(client.decoder_control_.described_);
         char* const sdpDescription = result_string;
         env << *rtsp_client << "Got a SDP description:\n"
             << sdpDescription << "\n";
 
-        // Create a media session object from this SDP description:
-        state.session_ = MediaSession::createNew(env, sdpDescription);
+        // Kept for reconnecting, the base URL may have come with the description. live555 takes
+        // the credentials from the URL it connects to, a Content-Base URL has none.
+        client.sdp_ = sdpDescription;
+        client.base_url_ = with_credentials(rtsp_client->url(), client.rtsp_url_);
+
+        bool is_started = client.start_session(sdpDescription);
         delete[] sdpDescription; // because we don't need it anymore
-        if (state.session_ == nullptr) {
-            env << *rtsp_client
-                << "Failed to create a MediaSession object from the SDP "
-                   "description: "
-                << env.getResultMsg() << "\n";
-            break;
-        }
-        if (state.session_->hasSubsessions() == False) {
-            env << *rtsp_client
-                << "This session has no media subsessions (i.e., no \"m=\" "
-                   "lines)\n";
+        if (!is_started) {
             break;
         }
-
-        // Then, create and set up our data source objects for the session.  We
-        // do this by iterating over the session's 'subsessions', calling
-        // "MediaSubsession::initiate()", and then sending a RTSP "SETUP"
-        // command, on each one. (Each 'subsession' will have its own data
-        // source.)
-        state.subsession_iterator_ = new MediaSubsessionIterator(*state.session_);
-        setupNextSubsession(rtsp_client);
         return;
     } while (false);
 
@@ -205,7 +518,7 @@ static void rtspcam::setupNextSubsession(RTSPClient* rtsp_client)
 
     state.subsession_ = state.subsession_iterator_->next();
     if (state.subsession_ != NULL) {
-        if (strcmp(state.subsession_->codecName(), "H264") != 0) {
+        if (!video_codec(*state.subsession_)) {
             setupNextSubsession(rtsp_client);
             return;
         }
@@ -271,7 +584,7 @@ static void rtspcam::continueAfterSETUP(RTSPClient* rtsp_client, int result_code
         // receive data; the actual flow of data from the client won't start
         // happening until later, after we've sent a RTSP "PLAY" command.)
 
-        // FIXME(bostjan): We handle only video/h264 sessions currently.
+        // FIXME(bostjan): We handle only video/h264 and video/h265 sessions currently.
 
         if constexpr (be_verbose) {
             std::cout << "&state:             " << &state << "\n"
@@ -285,15 +598,28 @@ static void rtspcam::continueAfterSETUP(RTSPClient* rtsp_client, int result_code
                       << "sprovps:            " << state.subsession_->fmtp_spropvps() << "\n";
         }
 
-        if (strcmp(state.subsession_->codecName(), "H264") == 0) {
-            char const* sprop_parameters = state.subsession_->fmtp_spropparametersets();
+        auto codec = video_codec(*state.subsession_);
+        if (codec) {
             std::vector<uint8_t> extradata;
-            if (sprop_parameters) {
-                extradata = decode_sprop_parameters(sprop_parameters);
+            if (codec == VideoCodec::H265) {
+                // each kind of parameter set has its own attribute (RFC 7798)
+                for (char const* sprop_parameters : { state.subsession_->fmtp_spropvps(),
+                         state.subsession_->fmtp_spropsps(), state.subsession_->fmtp_sproppps() }) {
+                    if (sprop_parameters) {
+                        auto parameter_sets = decode_sprop_parameters(sprop_parameters);
+                        extradata.insert(extradata.end(), parameter_sets.begin(), parameter_sets.end());
+                    }
+                }
+            } else {
+                char const* sprop_parameters = state.subsession_->fmtp_spropparametersets();
+                if (sprop_parameters) {
+                    extradata = decode_sprop_parameters(sprop_parameters);
+                }
             }
+            client.prepare_decoder(*codec, std::move(extradata));
 
-            state.subsession_->sink = VideoSink::create(env, *state.subsession_, client.swapper_,
-                { extradata.data(), extradata.size() }, rtsp_client->url());
+            state.subsession_->sink = VideoSink::create(env, *state.subsession_, *client.decoder_,
+                client.decoder_control_, *codec, rtsp_client->url());
             if (state.subsession_->sink == nullptr) {
                 env << *rtsp_client << "Failed to create a data sink for the \""
                     << *state.subsession_ << "\" subsession: " << env.getResultMsg() << "\n";
@@ -331,7 +657,8 @@ static void rtspcam::continueAfterPLAY(RTSPClient* rtsp_client, int result_code,
 
     do {
         UsageEnvironment& env = rtsp_client->envir();
-        RtspCameraClient::StreamState& state = (static_cast<RtspCameraClient*>(rtsp_client))->stream_state_;
+        RtspCameraClient& client = *static_cast<RtspCameraClient*>(rtsp_client);
+        RtspCameraClient::StreamState& state = client.stream_state_;
 
         if (result_code != 0) {
             env << *rtsp_client << "Failed to start playing session: " << result_string << "\n";
@@ -364,6 +691,13 @@ static void rtspcam::continueAfterPLAY(RTSPClient* rtsp_client, int result_code,
         state.session_timeout_broken_server_task_ = env.taskScheduler().scheduleDelayedTask(
             55UL * 1'000'000, (TaskFunc*)sessionTimeoutBrokenServerHandle, rtsp_client);
 
+        env.taskScheduler().unscheduleDelayedTask(client.handshake_timeout_task_);
+        client.idle_check_task_ = env.taskScheduler().scheduleDelayedTask(idle_check_interval,
+            (TaskFunc*)idleCheckHandler, rtsp_client);
+        client.playing_since_ = steady_time_us();
+        DecoderControl::mark(client.decoder_control_.playing_);
+        client.handshake_done();
+
         success = True;
     } while (false);
 
@@ -375,6 +709,69 @@ static void rtspcam::continueAfterPLAY(RTSPClient* rtsp_client, int result_code,
     }
 }
 
+static void rtspcam::continueAfterPAUSE(RTSPClient* rtsp_client, int result_code, char* result_string)
+{
+    // A server that can't pause keeps sending, the sinks drop what arrives. Nothing else to do.
+    if (result_code != 0) {
+        rtsp_client->envir() << *rtsp_client << "Failed to pause session: " << result_string << "\n";
+    }
+    delete[] result_string;
+}
+
+static void rtspcam::continueAfterRESUME(RTSPClient* rtsp_client, int result_code, char* result_string)
+{
+    if (result_code == 0) {
+        delete[] result_string;
+        return;
+    }
+
+    RtspCameraClient& client = *static_cast<RtspCameraClient*>(rtsp_client);
+    rtsp_client->envir() << *rtsp_client << "Failed to resume session: " << result_string << "\n";
+    std::ostringstream os;
+    os << "Failed to resume session: " << result_string;
+    client.error_message_ = os.str();
+    delete[] result_string;
+
+    shutdownStream(rtsp_client);
+}
+
+static void rtspcam::idleCheckHandler(void* client_data)
+{
+    RtspCameraClient& client = *static_cast<RtspCameraClient*>(client_data);
+    UsageEnvironment& env = client.envir();
+
+    int64_t now = steady_time_us();
+    int64_t last_packet = client.decoder_control_.last_packet_.load(std::memory_order_relaxed);
+    if (client.is_reconnecting_.load(std::memory_order_relaxed) && last_packet > client.playing_since_) {
+        env << client << "Reconnected\n";
+        client.is_reconnecting_.store(false, std::memory_order_relaxed);
+        client.reconnect_attempts_.store(0, std::memory_order_relaxed);
+        client.reconnects_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // a paused stream sends nothing, or only what the sinks drop
+    int64_t stall_timeout = client.stall_timeout_.load(std::memory_order_relaxed);
+    if (stall_timeout > 0 && !client.is_suspended_.load(std::memory_order_relaxed)
+        && now - std::max(last_packet, client.playing_since_) > stall_timeout) {
+        std::ostringstream os;
+        os << "No data received for " << stall_timeout / 1000 << " ms";
+        client.error_message_ = os.str();
+        env << client << client.error_message_.c_str() << "\n";
+        shutdownStream(&client);
+        return;
+    }
+
+    int64_t timeout = client.idle_timeout_.load(std::memory_order_relaxed);
+    int64_t idle = now - client.last_activity_.load(std::memory_order_relaxed);
+    if (timeout > 0 && idle > timeout && client.awake_holds_.load(std::memory_order_relaxed) == 0
+        && !client.is_suspended_.load(std::memory_order_relaxed)) {
+        client.suspend();
+    }
+
+    client.idle_check_task_ = env.taskScheduler().scheduleDelayedTask(idle_check_interval,
+        (TaskFunc*)idleCheckHandler, &client);
+}
+
 static void subsessionAfterPlaying(void* client_data)
 {
     MediaSubsession* subsession = (MediaSubsession*)client_data;
@@ -444,42 +841,21 @@ static void rtspcam::shutdownStream(RTSPClient* rtsp_client)
 {
     UsageEnvironment& env = rtsp_client->envir();
     auto& client = *static_cast<RtspCameraClient*>(rtsp_client);
-    RtspCameraClient::StreamState& state = client.stream_state_;
 
     if (client.already_shutteddown_) {
         return;
     }
 
-    // First, check whether any subsessions have still to be closed:
-    if (state.session_ != NULL) {
-        Boolean someSubsessionsWereActive = False;
-        MediaSubsessionIterator iter(*state.session_);
-        MediaSubsession* subsession;
-
-        while ((subsession = iter.next()) != NULL) {
-            if (subsession->sink != NULL) {
-                Medium::close(subsession->sink);
-                subsession->sink = NULL;
-
-                if (subsession->rtcpInstance() != NULL) {
-                    subsession->rtcpInstance()->setByeHandler(
-                        NULL, NULL); // in case the server sends a RTCP "BYE"
-                                     // while handling "TEARDOWN"
-                }
-
-                someSubsessionsWereActive = True;
-            }
-        }
-
-        if (someSubsessionsWereActive == True) {
-            // Send a RTSP "TEARDOWN" command, to tell the server to shutdown
-            // the stream. Don't bother handling the response to the "TEARDOWN".
-            rtsp_client->sendTeardownCommand(*state.session_, NULL);
-        }
+    client.close_session();
+    client.handshake_done();
+    // readers keep waiting while the stream comes back
+    if (!client.is_quitting_ && client.schedule_reconnect()) {
+        return;
     }
 
     env << *rtsp_client << "Closing the stream.\n";
     client.already_shutteddown_ = true;
+    client.is_reconnecting_.store(false, std::memory_order_relaxed);
     client.error_slot_.set(client.error_message_);
 }
 
@@ -495,31 +871,37 @@ static UsageEnvironment& operator<<(UsageEnvironment& env, MediaSubsession const
 
 VideoSink* VideoSink::create(UsageEnvironment& env,
     MediaSubsession& subsession,
-    Swapper<VideoFramePtr>& swapper,
-    Slice extradata,
+    Decoder& decoder,
+    DecoderControl& decoder_control,
+    VideoCodec codec,
     char const* stream_id)
 {
-    return new VideoSink(env, subsession, swapper, extradata, stream_id);
+    return new VideoSink(env, subsession, decoder, decoder_control, codec, stream_id);
 }
 
 VideoSink::VideoSink(UsageEnvironment& env,
     MediaSubsession& subsession,
-    Swapper<VideoFramePtr>& swapper,
-    Slice extradata,
+    Decoder& decoder,
+    DecoderControl& decoder_control,
+    VideoCodec codec,
     char const* stream_id)
     : MediaSink(env)
     , subsession_(subsession)
     , receive_buffer_(receive_buffer_size + 4)
     , stream_id_(stream_id)
-    , waiting_for_sps_unit_(true)
-    , decoder_(swapper, extradata)
+    , decoder_control_(decoder_control)
+    , codec_(codec)
+    , skipping_to_keyframe_(true)
+    , is_chain_broken_(false)
+    , is_suspended_(false)
+    , keyframe_due_(false)
+    , last_keyframe_request_(0)
+    , fir_sequence_(0)
+    , packets_lost_(0)
+    , decoder_(decoder)
 {
     static constexpr std::array<uint8_t, 4> start_marker { 0x00, 0x00, 0x00, 0x01 };
     std::copy(start_marker.begin(), start_marker.end(), receive_buffer_.begin());
-    if (extradata.size_ > 0) {
-        // FIXME(bostjan): Not working as intended
-        // waiting_for_sps_unit_ = false;
-    }
 }
 
 void VideoSink::afterGettingFrame(void* clientData,
@@ -589,19 +971,156 @@ void VideoSink::afterGettingFrame(unsigned frameSize,
         }
     }
 
-    if (waiting_for_sps_unit_ && receive_buffer_[4] == 0x67) {
-        // got sps unit
-        waiting_for_sps_unit_ = false;
-    }
-
-    if (!waiting_for_sps_unit_) {
-        decoder_.send({ receive_buffer_.data(), frameSize + 4 }, presentationTime.tv_usec);
+    DecoderControl::mark(decoder_control_.first_packet_);
+    decoder_control_.last_packet_.store(steady_time_us(), std::memory_order_relaxed);
+
+    // presentation times are wall clock once rtcp sender reports arrive
+    int64_t pts = (int64_t)presentationTime.tv_sec * 1000000 + presentationTime.tv_usec;
+    if (!is_suspended_) {
+        check_packet_loss();
+        if (should_decode(receive_buffer_[4], pts)) {
+            // parameter sets share the keyframe's time, only slices mark their picture
+            bool is_damaged = is_chain_broken_ && classify_nal(codec_, receive_buffer_[4]) == NalKind::FRAME;
+            decoder_.send({ receive_buffer_.data(), frameSize + 4 }, pts, is_damaged);
+        }
+        maybe_request_keyframe();
     }
 
     // Then continue, to request the next frame of data:
     continuePlaying();
 }
 
+void VideoSink::suspend()
+{
+    is_suspended_ = true;
+    open_keyframe_pts_.reset();
+    decoder_.flush();
+}
+
+void VideoSink::resume()
+{
+    is_suspended_ = false;
+    // references were flushed with the decoder
+    skipping_to_keyframe_ = true;
+    is_chain_broken_ = false;
+}
+
+bool VideoSink::should_decode(uint8_t header, int64_t pts)
+{
+    auto kind = classify_nal(codec_, header);
+    bool is_key = kind == NalKind::KEYFRAME || kind == NalKind::PARAMETER_SET;
+
+    if (decoder_control_.keyframes_only()) {
+        skipping_to_keyframe_ = true;
+    } else if (kind == NalKind::KEYFRAME) {
+        // pictures before it would refer to ones the decoder never saw
+        skipping_to_keyframe_ = false;
+        is_chain_broken_ = false;
+    }
+
+    if (!skipping_to_keyframe_ || is_key) {
+        if (kind == NalKind::KEYFRAME) {
+            on_keyframe();
+            open_keyframe_pts_ = pts;
+        }
+        return true;
+    }
+
+    // The parser ends an access unit only when the next one starts, which would hold every
+    // keyframe back by a whole GOP. A delimiter ends it right away.
+    if (open_keyframe_pts_) {
+        if (codec_ == VideoCodec::H265) {
+            decoder_.send({ h265_access_unit_delimiter, sizeof(h265_access_unit_delimiter) },
+                open_keyframe_pts_.value());
+        } else {
+            decoder_.send({ h264_access_unit_delimiter, sizeof(h264_access_unit_delimiter) },
+                open_keyframe_pts_.value());
+        }
+        open_keyframe_pts_.reset();
+    }
+
+    decoder_control_.units_discarded_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void VideoSink::check_packet_loss()
+{
+    auto* source = subsession_.rtpSource();
+    if (source == nullptr) {
+        return;
+    }
+    auto* stats = source->receptionStatsDB().lookup(source->lastReceivedSSRC());
+    if (stats == nullptr) {
+        return;
+    }
+
+    // duplicates can make up for lost packets, the count never goes down
+    uint64_t expected = stats->totNumPacketsExpected();
+    uint64_t received = stats->totNumPacketsReceived();
+    uint64_t lost = expected > received ? expected - received : 0;
+    if (lost > packets_lost_) {
+        decoder_control_.packets_lost_.fetch_add(lost - packets_lost_, std::memory_order_relaxed);
+        decoder_control_.gaps_.fetch_add(1, std::memory_order_relaxed);
+        packets_lost_ = lost;
+        keyframe_due_ = true;
+
+        // live555 drops a unit that lost a fragment, what follows refers to an incomplete picture
+        is_chain_broken_ = true;
+        if (decoder_control_.loss_policy_.load(std::memory_order_relaxed) == LossPolicy::SKIP_TO_KEYFRAME) {
+            skipping_to_keyframe_ = true;
+        }
+    }
+}
+
+void VideoSink::maybe_request_keyframe()
+{
+    if (decoder_control_.keyframe_wanted_.load(std::memory_order_relaxed)) {
+        decoder_control_.keyframe_wanted_.store(false, std::memory_order_relaxed);
+        keyframe_due_ = true;
+    }
+
+    // keyframe-only mode waits for keyframes on purpose
+    bool is_joining = skipping_to_keyframe_ && !decoder_control_.keyframes_only();
+    if (!keyframe_due_ && !is_joining) {
+        return;
+    }
+
+    int64_t now = steady_time_us();
+    if (now - last_keyframe_request_ < keyframe_request_interval) {
+        return;
+    }
+
+    auto* source = subsession_.rtpSource();
+    auto* rtcp = subsession_.rtcpInstance();
+    if (source == nullptr || rtcp == nullptr || rtcp->RTCPgs() == nullptr) {
+        return;
+    }
+
+    // over RTP/UDP only, interleaved RTCP would have to go through the RTSP connection
+    auto packet = make_keyframe_request(source->SSRC(), source->lastReceivedSSRC(), fir_sequence_++,
+        subsession_.parentSession().CNAME());
+    rtcp->RTCPgs()->output(envir(), packet.data(), (unsigned)packet.size());
+
+    keyframe_due_ = false;
+    last_keyframe_request_ = now;
+    if (!keyframe_requested_) {
+        keyframe_requested_ = now;
+    }
+    decoder_control_.keyframe_requests_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void VideoSink::on_keyframe()
+{
+    DecoderControl::mark(decoder_control_.first_keyframe_);
+
+    keyframe_due_ = false;
+    if (keyframe_requested_) {
+        decoder_control_.keyframe_recovery_.store(steady_time_us() - keyframe_requested_.value(),
+            std::memory_order_relaxed);
+        keyframe_requested_.reset();
+    }
+}
+
 Boolean VideoSink::continuePlaying()
 {
     if (fSource == NULL)
@@ -614,6 +1133,44 @@ Boolean VideoSink::continuePlaying()
     return True;
 }
 
+static std::optional<VideoCodec> video_codec(MediaSubsession const& subsession)
+{
+    // live555 depacketizes both, including fragmentation and aggregation units
+    if (strcmp(subsession.codecName(), "H264") == 0) {
+        return VideoCodec::H264;
+    }
+    if (strcmp(subsession.codecName(), "H265") == 0) {
+        return VideoCodec::H265;
+    }
+    return {};
+}
+
+// Returns the "user:password@" part of `url`, if it has one.
+static std::optional<std::string> url_credentials(std::string const& url)
+{
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos) {
+        return {};
+    }
+    auto host = scheme_end + 3;
+    auto path = url.find('/', host);
+    auto at = url.rfind('@', path == std::string::npos ? std::string::npos : path - 1);
+    if (at == std::string::npos || at < host) {
+        return {};
+    }
+    return url.substr(host, at + 1 - host);
+}
+
+static std::string with_credentials(std::string const& url, std::string const& credentials_url)
+{
+    auto credentials = url_credentials(credentials_url);
+    auto scheme_end = url.find("://");
+    if (!credentials || scheme_end == std::string::npos || url_credentials(url)) {
+        return url;
+    }
+    return url.substr(0, scheme_end + 3) + credentials.value() + url.substr(scheme_end + 3);
+}
+
 static std::vector<uint8_t> decode_sprop_parameters(char const* sprop_parameters)
 {
     // feed decoder the sprop parameters
@@ -6,17 +6,25 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <liveMedia.hh>
 
 #include "decoder.hpp"
 #include "error_slot.hpp"
+#include "event_loop.hpp"
 #include "rtsp_camera.hpp"
-#include "swapper.hpp"
+#include "frame_channel.hpp"
 #include "video_frame.hpp"
 
 namespace rtspcam {
@@ -26,6 +34,11 @@ static void continueAfterDESCRIBE(RTSPClient* rtsp_client, int result_code, char
 static void setupNextSubsession(RTSPClient* rtsp_client);
 static void continueAfterSETUP(RTSPClient* rtsp_client, int result_code, char* result_string);
 static void continueAfterPLAY(RTSPClient* rtsp_client, int result_code, char* result_string);
+static void continueAfterPAUSE(RTSPClient* rtsp_client, int result_code, char* result_string);
+static void continueAfterRESUME(RTSPClient* rtsp_client, int result_code, char* result_string);
+static void idleCheckHandler(void* client_data);
+static void reconnectHandler(void* client_data);
+static void handshakeTimeoutHandler(void* client_data);
 static void streamTimerHandler(void* client_data);
 static void sessionTimeoutBrokenServerHandle(RTSPClient* rtsp_client);
 
@@ -33,18 +46,40 @@ class RtspCameraClient : public RTSPClient {
 public:
     virtual ~RtspCameraClient() override;
 
-    void quit();
+    // Sends DESCRIBE. `on_started` is called once the first handshake is over, whether the stream
+    // plays or failed. Loop thread.
+    void start(std::function<void()> on_started = {});
+    // Ends the stream, the client can be closed afterwards. Loop thread.
     void on_quit();
 
+    // Pauses the stream with RTSP PAUSE once nobody showed interest in it for `timeout`, zero
+    // never pauses. Any thread.
+    void set_idle_timeout(std::chrono::milliseconds timeout);
+    // Marks the stream as wanted, resumes it with PLAY if it is paused. Any thread.
+    void touch();
+    // Keeps the stream playing regardless of the idle timeout while held, for readers that get
+    // frames without asking. Any thread.
+    void hold_awake(bool hold);
+    bool is_suspended() const { return is_suspended_.load(std::memory_order_relaxed); }
+    uint64_t suspends() const { return suspends_.load(std::memory_order_relaxed); }
+    void on_resume();
+    // Any thread, see `RtspCamera::set_reconnect`.
+    void set_reconnect(std::optional<ReconnectPolicy> const& policy);
+    bool is_reconnecting() const { return is_reconnecting_.load(std::memory_order_relaxed); }
+    uint64_t reconnects() const { return reconnects_.load(std::memory_order_relaxed); }
+    int reconnect_attempts() const { return reconnect_attempts_.load(std::memory_order_relaxed); }
+
     struct Deleter {
         void operator()(RtspCameraClient* p) { Medium::close(p); }
     };
 
+    // Loop thread.
     static std::unique_ptr<RtspCameraClient, RtspCameraClient::Deleter> create(
-        UsageEnvironment& environment,
+        EventLoop& loop,
         std::string const& rtsp_url,
-        Swapper<VideoFramePtr>& swapper,
-        ErrorSlot& error_slot);
+        FrameChannel& channel,
+        ErrorSlot& error_slot,
+        DecoderControl& decoder_control);
 
     struct StreamState {
         ~StreamState();
@@ -55,28 +90,81 @@ public:
         TaskToken stream_timer_task_;
         TaskToken session_timeout_broken_server_task_;
         double duration_;
+
+        // Unschedules the session's tasks and deletes it.
+        void close();
     };
 
 private:
-    RtspCameraClient(UsageEnvironment& environment,
+    RtspCameraClient(EventLoop& loop,
         std::string const& rtsp_url,
-        Swapper<VideoFramePtr>& swapper,
-        ErrorSlot& error_slot_);
+        FrameChannel& channel,
+        ErrorSlot& error_slot,
+        DecoderControl& decoder_control);
 
-    std::thread thread_;
-    Swapper<VideoFramePtr>& swapper_;
+    EventLoop& loop_;
+    FrameChannel& channel_;
     ErrorSlot& error_slot_;
+    DecoderControl& decoder_control_;
     std::string error_message_;
-    EventTriggerId quit_trigger_;
-    char quit_flag_;
     bool already_shutteddown_;
+    bool is_quitting_;
     StreamState stream_state_;
+    void handshake_done();
+    std::function<void()> on_started_;
+    // From DESCRIBE, or SETUP when reconnecting, to a successful PLAY.
+    void schedule_handshake_timeout();
+    TaskToken handshake_timeout_task_;
+
+    // Created with the parameter sets of the first session and kept across reconnects, unless
+    // the camera comes back with another codec.
+    void prepare_decoder(VideoCodec codec, std::vector<uint8_t> extradata);
+    std::unique_ptr<Decoder> decoder_;
+    std::vector<uint8_t> extradata_;
+    VideoCodec codec_;
+
+    // Starts the session described by `sdp`, returns false if there is nothing to set up.
+    bool start_session(char const* sdp);
+    void close_session();
+
+    // reconnects, delays in microseconds
+    bool schedule_reconnect();
+    void reconnect();
+    std::string const rtsp_url_;
+    // the last session description and the URL it is relative to
+    std::string sdp_;
+    std::string base_url_;
+    std::mutex reconnect_mutex_;
+    std::optional<ReconnectPolicy> reconnect_policy_;
+    std::atomic<int64_t> stall_timeout_;
+    std::minstd_rand random_;
+    TaskToken reconnect_task_;
+    // steady clock time the session started or resumed playing
+    int64_t playing_since_;
+    std::atomic<bool> is_reconnecting_;
+    std::atomic<uint64_t> reconnects_;
+    std::atomic<int> reconnect_attempts_;
+
+    // idle suspend, times in microseconds of the steady clock
+    void suspend();
+    TaskToken idle_check_task_;
+    std::atomic<int64_t> idle_timeout_;
+    std::atomic<int64_t> last_activity_;
+    std::atomic<int> awake_holds_;
+    std::atomic<bool> is_suspended_;
+    std::atomic<bool> is_resume_posted_;
+    std::atomic<uint64_t> suspends_;
 
     friend void shutdownStream(RTSPClient*);
     friend void continueAfterDESCRIBE(RTSPClient*, int, char*);
     friend void setupNextSubsession(RTSPClient*);
     friend void continueAfterSETUP(RTSPClient*, int, char*);
     friend void continueAfterPLAY(RTSPClient*, int, char*);
+    friend void continueAfterPAUSE(RTSPClient*, int, char*);
+    friend void continueAfterRESUME(RTSPClient*, int, char*);
+    friend void idleCheckHandler(void*);
+    friend void reconnectHandler(void*);
+    friend void handshakeTimeoutHandler(void*);
     friend void streamTimerHandler(void*);
     friend void sessionTimeoutBrokenServerHandle(RTSPClient*);
 };
@@ -4,105 +4,737 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
-#include <BasicUsageEnvironment.hh>
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
 
+#include "decoder.hpp"
 #include "error_slot.hpp"
+#include "event_loop.hpp"
+#include "frame_channel.hpp"
+#include "frame_converter.hpp"
+#include "governor.hpp"
 #include "rtsp_camera.hpp"
 #include "rtsp_camera_client.hpp"
+#include "swapper.hpp"
 #include "video_frame.hpp"
-#include "video_scaler.hpp"
 
 using namespace rtspcam;
 
-struct UsageEnvironmentDeleter {
-    void operator()(UsageEnvironment* p)
+// A reader that hasn't called `read` for this long no longer gets frames converted for it.
+static constexpr std::chrono::seconds reader_idle_timeout(1);
+
+// What a reader lets the shared decoder leave out.
+struct DecodeNeeds {
+    bool gray_;
+    bool drop_nonref_;
+    bool keyframes_only_;
+};
+
+// One RTSP session and its decoder, shared by a camera and all of its subscribers. The session
+// ends when the last of them is gone, which must not happen on the thread of a loop, see
+// `release_session`.
+struct Session : public std::enable_shared_from_this<Session> {
+    Session(std::string const& url, std::shared_ptr<EventLoop> loop);
+    ~Session();
+
+    // Starts the RTSP handshake, see `RtspCameraClient::start`.
+    void start(std::function<void()> on_started = {});
+    // Records what `reader` lets the decoder leave out, nothing once it is gone, and updates the
+    // decoder's settings to what every reader lets it leave out.
+    void set_needs(void const* reader, std::optional<DecodeNeeds> const& needs);
+
+    FrameChannel channel_;
+    ErrorSlot error_slot_;
+    DecoderControl decoder_control_;
+    std::mutex needs_mutex_;
+    std::map<void const*, DecodeNeeds> needs_;
+
+    std::shared_ptr<EventLoop> loop_;
+    std::unique_ptr<RtspCameraClient, RtspCameraClient::Deleter> client_;
+};
+
+// Lets a bounded number of sessions do their RTSP handshakes at a time. Shared by the sessions
+// opened together, which take turns in the order they were added.
+class HandshakeLimiter : public std::enable_shared_from_this<HandshakeLimiter> {
+public:
+    HandshakeLimiter(size_t max_handshakes)
+        : max_handshakes_(max_handshakes)
+        , num_handshakes_(0)
     {
-        auto ret = p->reclaim();
-        // FIXME(bostjan)
-        if (ret == False) {
-            std::cout << "not reclaimed" << std::endl;
-        }
     }
+
+    void add(std::weak_ptr<Session> session);
+
+private:
+    void begin(std::weak_ptr<Session> const& session);
+    void done();
+
+    std::mutex mutex_;
+    size_t const max_handshakes_;
+    size_t num_handshakes_;
+    std::deque<std::weak_ptr<Session>> waiting_;
 };
 
 class RtspCameraImpl : public RtspCamera {
 public:
-    RtspCameraImpl(std::string const& url);
+    RtspCameraImpl(std::shared_ptr<Session> session, Delivery const& delivery);
     virtual ~RtspCameraImpl() override;
+    std::shared_future<void> started() override;
     Image read() override;
+    Image peek() override;
+    std::unique_ptr<RtspCamera> subscribe(Delivery const& delivery) override;
+    uint64_t skipped_frames() override;
+    void set_delivery(Delivery const& delivery) override;
+    void set_max_rate(double fps, bool drop_nonref) override;
+    void set_keyframes_only(bool keyframes_only) override;
+    void set_priority(int priority) override;
+    void set_idle_timeout(std::chrono::milliseconds timeout) override;
+    void set_reconnect(std::optional<ReconnectPolicy> const& policy) override;
+    void set_loss_policy(LossPolicy policy) override;
+    void set_error_budget(int errors) override;
+    CameraStats stats() override;
+    RawFrame read_raw() override;
+    Image read_tensor(void* buffer, size_t size, TensorFormat const& format) override;
+    FrameSlot read_into(uint8_t* buffer, int stride, OutputSpec const& spec) override;
+    std::map<std::string, Image> read_outputs() override;
+    void on_frame(FrameCallback callback, Backpressure backpressure) override;
+    void on_error(ErrorCallback callback) override;
+    bool is_ready() override;
+    void set_ready_callback(ReadyCallback callback) override;
     void set_image_format(ImageFormat format) override;
     void set_size(int width, int height) override;
+    void set_conversion_threads(int num_threads) override;
+    void set_pipelined(bool pipelined) override;
+    void set_roi(std::optional<Rect> const& roi) override;
+    void add_output(std::string const& name, OutputSpec const& spec) override;
+    void remove_output(std::string const& name) override;
+    void set_roi(std::string const& name, Rect const& roi) override;
 
 private:
-    Swapper<VideoFramePtr> swapper_;
-    ErrorSlot error_slot_;
+    // Where a delivered frame is in the stream, and how many frames the rate limit dropped before it.
+    struct Position {
+        uint64_t frame_index_;
+        uint64_t decimated_;
+    };
+
+    // Images converted from a single decoded frame.
+    struct Converted {
+        std::optional<Image> image_;
+        std::optional<std::map<std::string, Image>> outputs_;
+        uint64_t decimated_ = 0;
+    };
+
+    Position pop_frame();
+    Converted pop_converted();
+    void start_conversion_thread();
+    std::shared_ptr<FrameCallback const> frame_callback(Backpressure backpressure);
+    void on_frame_decoded();
+    void on_stream_error(std::string const& error);
+    void report_started(std::optional<std::string> const& error);
+    void notify_ready();
+    uint64_t count_delivery(Position position, std::optional<Position>& last);
+    Image count_skipped(Image image, uint64_t decimated, std::optional<Position>& last);
+    std::map<std::string, Image> count_skipped(std::map<std::string, Image> images, uint64_t decimated);
+    Image convert_image(FrameConverter& converter, AVFrame const* frame, uint64_t frame_index);
+    void run_frame_callback(FrameCallback const& callback, AVFrame const* frame, Position position);
+    std::map<std::string, Image> convert_outputs(AVFrame const* frame, uint64_t frame_index);
+    void conversion_loop();
+    void update_decode_needs();
+
+    std::shared_ptr<Session> session_;
+    std::shared_ptr<FrameSubscription> subscription_;
+    ErrorSlot& error_slot_;
     VideoFramePtr video_frame_;
-    VideoScaler video_scaler_;
-    AVPixelFormat pixel_format_;
-    int width_;
-    int height_;
-    bool first_frame_;
-
-    std::unique_ptr<TaskScheduler> scheduler_;
-    std::unique_ptr<UsageEnvironment, UsageEnvironmentDeleter> environment_;
-    std::unique_ptr<RtspCameraClient, RtspCameraClient::Deleter> client_;
+    FrameConverter frame_converter_;
+    std::map<std::string, FrameConverter> output_converters_;
+    ImageFormat image_format_;
+    int num_threads_;
+    // what this reader asked the decoder to leave out, see `Session::set_needs`
+    bool drop_nonref_;
+    bool keyframes_only_;
+    // batched reads converted a frame in colour
+    std::atomic<bool> has_color_batch_;
+    // settings are only taken until the first frame is read or a callback is set
+    std::atomic<bool> first_frame_;
+    // position of the previous image handed out by `read`
+    std::optional<Position> last_read_position_;
+    // frame taken by `peek`, handed out by the next `pop_frame`
+    std::optional<Position> peeked_;
+    // image taken by `peek` in pipelined mode, handed out by the next `read`
+    std::optional<Image> peeked_image_;
+    std::atomic<uint64_t> frames_delivered_;
+    std::atomic<uint64_t> callback_errors_;
+    // steady clock time of the first delivery, 0 before
+    std::atomic<int64_t> first_delivery_;
+    // fulfilled by the first frame or error
+    std::promise<void> started_;
+    std::shared_future<void> started_future_;
+    std::atomic<bool> has_started_;
+
+    // regions of interest and outputs can be changed from any thread while reading
+    std::mutex outputs_mutex_;
+    std::optional<Rect> roi_;
+    std::map<std::string, OutputSpec> outputs_;
+
+    // pipelined mode, frames are converted on `conversion_thread_` and handed over via `converted_`
+    bool pipelined_;
+    Swapper<Converted> converted_;
+    std::atomic<bool> wants_image_;
+    std::atomic<bool> wants_outputs_;
+    std::mutex reader_mutex_;
+    std::condition_variable reader_condvar_;
+    std::chrono::steady_clock::time_point last_read_;
+    bool quit_;
+    std::thread conversion_thread_;
+
+    // callbacks are copied out under the lock and run without it, so they may replace themselves
+    std::mutex callback_mutex_;
+    std::shared_ptr<FrameCallback const> frame_callback_;
+    Backpressure backpressure_;
+    std::atomic<bool> has_latest_callback_;
+    std::shared_ptr<ErrorCallback const> error_callback_;
+    std::shared_ptr<ReadyCallback const> ready_callback_;
+    VideoFramePtr callback_frame_;
+    // Held while a frame callback runs, on the decoder thread or the conversion thread. Callbacks
+    // have a converter of their own, `read` may run at the same time.
+    std::mutex callback_run_mutex_;
+    std::atomic<std::thread::id> callback_thread_;
+    FrameConverter callback_converter_;
+    std::optional<Position> last_callback_position_;
+    // a frame callback keeps an idle stream from being paused
+    bool holds_awake_;
+
+    // batched reads keep the last frame, so that a camera without a new one still fills its slot
+    FrameConverter batch_converter_;
+    VideoFramePtr batch_frame_;
+    std::optional<uint64_t> batch_frame_index_;
 };
 
-RtspCameraImpl::RtspCameraImpl(std::string const& url)
-    : swapper_(make_videoframe())
+Session::Session(std::string const& url, std::shared_ptr<EventLoop> loop)
+    : loop_(std::move(loop))
+    , client_(nullptr, RtspCameraClient::Deleter())
+{
+    error_slot_.set_listener([this](std::string const& error) { channel_.close(error); });
+    // live555 objects are only touched on the loop's thread
+    loop_->run([&]() {
+        client_ = RtspCameraClient::create(*loop_, url, channel_, error_slot_, decoder_control_);
+    });
+    Governor::instance().add(decoder_control_, url);
+}
+
+Session::~Session()
+{
+    Governor::instance().remove(decoder_control_);
+    loop_->run([this]() {
+        client_->on_quit();
+        client_.reset();
+    });
+}
+
+// Drops references to sessions on a thread of its own. The thread is joined when the process
+// exits, before the statics a session ends with (the governor) are destroyed: they were
+// constructed by the first session, before the reaper.
+class SessionReaper {
+public:
+    static SessionReaper& instance()
+    {
+        static SessionReaper reaper;
+        return reaper;
+    }
+
+    void release(std::shared_ptr<Session> session)
+    {
+        {
+            std::scoped_lock lock(mutex_);
+            sessions_.push_back(std::move(session));
+        }
+        condvar_.notify_one();
+    }
+
+private:
+    SessionReaper()
+        : quit_(false)
+        , thread_([this]() { run(); })
+    {
+    }
+
+    ~SessionReaper()
+    {
+        {
+            std::scoped_lock lock(mutex_);
+            quit_ = true;
+        }
+        condvar_.notify_one();
+        thread_.join();
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            condvar_.wait(lock, [this]() { return quit_ || !sessions_.empty(); });
+            if (sessions_.empty()) {
+                break;
+            }
+
+            // ending a session waits for its loop, the lock isn't held meanwhile
+            auto session = std::move(sessions_.front());
+            sessions_.pop_front();
+            lock.unlock();
+            session.reset();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable condvar_;
+    std::deque<std::shared_ptr<Session>> sessions_;
+    bool quit_;
+    std::thread thread_;
+};
+
+// Ending a session waits for a task on its loop. A reference taken on a loop's thread may turn out
+// to be the last one, it is handed to the reaper.
+static void release_session(std::shared_ptr<Session> session)
+{
+    if (session && EventLoop::is_loop_thread()) {
+        SessionReaper::instance().release(std::move(session));
+    }
+}
+
+void Session::start(std::function<void()> on_started)
+{
+    loop_->post([weak_session = weak_from_this(), on_started = std::move(on_started)]() mutable {
+        // a camera closed before the task ran doesn't start, its turn is over
+        auto session = weak_session.lock();
+        if (!session) {
+            if (on_started) {
+                on_started();
+            }
+            return;
+        }
+        session->client_->start(std::move(on_started));
+        release_session(std::move(session));
+    });
+}
+
+void Session::set_needs(void const* reader, std::optional<DecodeNeeds> const& needs)
+{
+    std::scoped_lock lock(needs_mutex_);
+    if (needs) {
+        needs_.insert_or_assign(reader, needs.value());
+    } else {
+        needs_.erase(reader);
+    }
+
+    DecodeNeeds all { !needs_.empty(), !needs_.empty(), !needs_.empty() };
+    for (auto const& [other, other_needs] : needs_) {
+        all.gray_ = all.gray_ && other_needs.gray_;
+        all.drop_nonref_ = all.drop_nonref_ && other_needs.drop_nonref_;
+        all.keyframes_only_ = all.keyframes_only_ && other_needs.keyframes_only_;
+    }
+    decoder_control_.gray_.store(all.gray_, std::memory_order_relaxed);
+    decoder_control_.drop_nonref_.store(all.drop_nonref_, std::memory_order_relaxed);
+    decoder_control_.keyframes_only_.store(all.keyframes_only_, std::memory_order_relaxed);
+}
+
+void HandshakeLimiter::add(std::weak_ptr<Session> session)
+{
+    {
+        std::scoped_lock lock(mutex_);
+        if (max_handshakes_ != 0 && num_handshakes_ >= max_handshakes_) {
+            waiting_.push_back(std::move(session));
+            return;
+        }
+        num_handshakes_ += 1;
+    }
+    begin(session);
+}
+
+void HandshakeLimiter::begin(std::weak_ptr<Session> const& session)
+{
+    // a camera closed while waiting gives its turn to the next one, called on a loop's thread
+    // when an earlier handshake is done
+    if (auto started = session.lock()) {
+        started->start([self = shared_from_this()]() { self->done(); });
+        release_session(std::move(started));
+    } else {
+        done();
+    }
+}
+
+void HandshakeLimiter::done()
+{
+    std::weak_ptr<Session> next;
+    {
+        std::scoped_lock lock(mutex_);
+        if (waiting_.empty()) {
+            num_handshakes_ -= 1;
+            return;
+        }
+        next = std::move(waiting_.front());
+        waiting_.pop_front();
+    }
+    begin(next);
+}
+
+RtspCameraImpl::RtspCameraImpl(std::shared_ptr<Session> session, Delivery const& delivery)
+    : session_(std::move(session))
+    , subscription_(std::make_shared<FrameSubscription>(delivery))
+    , error_slot_(subscription_->error_slot())
     , video_frame_(make_videoframe())
-    , pixel_format_(AV_PIX_FMT_RGB24)
-    , width_(0)
-    , height_(0)
+    , image_format_(ImageFormat::RGB)
+    , num_threads_(1)
+    , drop_nonref_(false)
+    , keyframes_only_(false)
+    , has_color_batch_(false)
     , first_frame_(true)
-    , scheduler_(BasicTaskScheduler::createNew())
-    , environment_(BasicUsageEnvironment::createNew(*scheduler_), UsageEnvironmentDeleter())
-    , client_(RtspCameraClient::create(*environment_, url, swapper_, error_slot_))
+    , frames_delivered_(0)
+    , callback_errors_(0)
+    , first_delivery_(0)
+    , started_future_(started_.get_future().share())
+    , has_started_(false)
+    , pipelined_(false)
+    , converted_(Converted {})
+    , wants_image_(false)
+    , wants_outputs_(false)
+    , quit_(false)
+    , backpressure_(Backpressure::LATEST)
+    , has_latest_callback_(false)
+    , callback_frame_(make_videoframe())
+    , callback_thread_(std::thread::id())
+    , holds_awake_(false)
+    , batch_frame_(make_videoframe())
 {
+    // listeners must be in place before the channel starts pushing frames and errors
+    subscription_->set_listener([this]() { on_frame_decoded(); });
+    converted_.set_listener([this]() { notify_ready(); });
+    error_slot_.set_listener([this](std::string const& error) { on_stream_error(error); });
+
+    update_decode_needs();
+    session_->channel_.attach(subscription_);
 }
 
 RtspCameraImpl::~RtspCameraImpl()
 {
-    client_->quit();
+    // the decoder thread must be done with this reader before anything is torn down
+    subscription_->detach();
+    // the remaining readers may let the decoder leave out more again
+    session_->set_needs(this, std::nullopt);
+    if (holds_awake_) {
+        session_->client_->hold_awake(false);
+    }
+
+    {
+        std::scoped_lock lock(reader_mutex_);
+        quit_ = true;
+    }
+    reader_condvar_.notify_one();
+
+    if (conversion_thread_.joinable()) {
+        conversion_thread_.join();
+    }
 }
 
 std::unique_ptr<RtspCamera> RtspCamera::open(std::string const& url)
 {
-    return std::make_unique<RtspCameraImpl>(url);
+    // a loop of its own, like a thread per camera
+    auto session = std::make_shared<Session>(url, std::make_shared<EventLoop>());
+    auto camera = std::make_unique<RtspCameraImpl>(session, Delivery());
+    session->start();
+    return camera;
+}
+
+std::vector<std::unique_ptr<RtspCamera>> RtspCamera::open_all(std::vector<std::string> const& urls,
+    OpenOptions const& options)
+{
+    auto limiter = std::make_shared<HandshakeLimiter>(options.max_handshakes_);
+
+    std::vector<std::unique_ptr<RtspCamera>> cameras;
+    cameras.reserve(urls.size());
+    for (auto const& url : urls) {
+        auto session = std::make_shared<Session>(url, EventLoop::shared());
+        // readers are attached before the stream starts, so none misses its first frame
+        cameras.push_back(std::make_unique<RtspCameraImpl>(session, Delivery()));
+        limiter->add(session);
+    }
+    return cameras;
+}
+
+std::shared_future<void> RtspCameraImpl::started()
+{
+    return started_future_;
+}
+
+std::unique_ptr<RtspCamera> RtspCameraImpl::subscribe(Delivery const& delivery)
+{
+    // the new reader needs chroma and every frame until it asks otherwise
+    return std::make_unique<RtspCameraImpl>(session_, delivery);
+}
+
+uint64_t RtspCameraImpl::skipped_frames()
+{
+    return subscription_->skipped();
+}
+
+void RtspCameraImpl::set_delivery(Delivery const& delivery)
+{
+    subscription_->set_delivery(delivery);
+}
+
+void RtspCameraImpl::set_max_rate(double fps, bool drop_nonref)
+{
+    subscription_->set_max_rate(fps);
+    drop_nonref_ = drop_nonref && fps > 0;
+    update_decode_needs();
+}
+
+void RtspCameraImpl::set_keyframes_only(bool keyframes_only)
+{
+    keyframes_only_ = keyframes_only;
+    update_decode_needs();
+}
+
+void RtspCameraImpl::update_decode_needs()
+{
+    // chroma can be left out only if nothing this reader converts has colour, callbacks use the
+    // image format
+    bool gray = image_format_ == ImageFormat::GRAY && !has_color_batch_.load(std::memory_order_relaxed);
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        for (auto const& [name, spec] : outputs_) {
+            gray = gray && spec.format_ == ImageFormat::GRAY;
+        }
+    }
+    session_->set_needs(this, DecodeNeeds { gray, drop_nonref_, keyframes_only_ });
+}
+
+void RtspCameraImpl::set_priority(int priority)
+{
+    session_->decoder_control_.priority_.store(priority, std::memory_order_relaxed);
+}
+
+void RtspCameraImpl::set_idle_timeout(std::chrono::milliseconds timeout)
+{
+    session_->client_->set_idle_timeout(timeout);
+}
+
+void RtspCameraImpl::set_reconnect(std::optional<ReconnectPolicy> const& policy)
+{
+    session_->client_->set_reconnect(policy);
+}
+
+void RtspCameraImpl::set_loss_policy(LossPolicy policy)
+{
+    session_->decoder_control_.loss_policy_.store(policy, std::memory_order_relaxed);
+}
+
+void RtspCameraImpl::set_error_budget(int errors)
+{
+    session_->decoder_control_.error_budget_.store(errors, std::memory_order_relaxed);
+}
+
+CameraStats RtspCameraImpl::stats()
+{
+    CameraStats stats;
+    stats.frames_decoded_ = session_->channel_.published();
+    stats.frames_delivered_ = frames_delivered_.load(std::memory_order_relaxed);
+    stats.frames_skipped_ = subscription_->skipped();
+    stats.frames_decimated_ = subscription_->decimated();
+    stats.packets_decoded_ = session_->decoder_control_.packets_decoded_.load(std::memory_order_relaxed);
+    stats.units_discarded_ = session_->decoder_control_.units_discarded_.load(std::memory_order_relaxed);
+    stats.quality_tier_ = session_->decoder_control_.tier();
+    stats.tier_changes_ = session_->decoder_control_.tier_changes_.load(std::memory_order_relaxed);
+    stats.decode_queue_depth_ = session_->decoder_control_.queue_depth_.load(std::memory_order_relaxed);
+    stats.is_suspended_ = session_->client_->is_suspended();
+    stats.suspends_ = session_->client_->suspends();
+    stats.resume_latency_ = session_->decoder_control_.resume_latency_.load(std::memory_order_relaxed);
+    stats.packets_lost_ = session_->decoder_control_.packets_lost_.load(std::memory_order_relaxed);
+    stats.keyframe_requests_ = session_->decoder_control_.keyframe_requests_.load(std::memory_order_relaxed);
+    stats.keyframe_recovery_ = session_->decoder_control_.keyframe_recovery_.load(std::memory_order_relaxed);
+    stats.is_reconnecting_ = session_->client_->is_reconnecting();
+    stats.reconnects_ = session_->client_->reconnects();
+    stats.reconnect_attempts_ = session_->client_->reconnect_attempts();
+    stats.gaps_ = session_->decoder_control_.gaps_.load(std::memory_order_relaxed);
+    stats.frames_concealed_ = session_->decoder_control_.frames_concealed_.load(std::memory_order_relaxed);
+    stats.decode_errors_ = session_->decoder_control_.decode_errors_.load(std::memory_order_relaxed);
+    stats.callback_errors_ = callback_errors_.load(std::memory_order_relaxed);
+
+    auto const& control = session_->decoder_control_;
+    int64_t describe_sent = control.describe_sent_.load(std::memory_order_relaxed);
+    auto since_describe = [describe_sent](std::atomic<int64_t> const& step) -> int64_t {
+        int64_t time = step.load(std::memory_order_relaxed);
+        return time == 0 ? -1 : time - describe_sent;
+    };
+    stats.startup_.described_ = since_describe(control.described_);
+    stats.startup_.playing_ = since_describe(control.playing_);
+    stats.startup_.first_packet_ = since_describe(control.first_packet_);
+    stats.startup_.first_keyframe_ = since_describe(control.first_keyframe_);
+    stats.startup_.first_frame_ = since_describe(control.first_frame_);
+    stats.startup_.first_read_ = since_describe(first_delivery_);
+    return stats;
+}
+
+RawFrame RtspCameraImpl::read_raw()
+{
+    if (pipelined_) {
+        throw std::runtime_error("Raw frames are not available in pipelined mode");
+    }
+    first_frame_ = false;
+
+    auto position = pop_frame();
+    auto const* frame = video_frame_.get();
+
+    auto pixfmt = (AVPixelFormat)frame->format;
+    auto const* desc = av_pix_fmt_desc_get(pixfmt);
+    if (desc == nullptr || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) != 0) {
+        throw std::runtime_error("Raw frames of this pixel format are not supported");
+    }
+
+    RawFrame raw;
+    raw.num_planes_ = av_pix_fmt_count_planes(pixfmt);
+    raw.width_ = frame->width;
+    raw.height_ = frame->height;
+    raw.pixel_format_ = desc->name;
+    raw.frame_index_ = position.frame_index_;
+    raw.timestamp_ = frame->pts == AV_NOPTS_VALUE ? -1 : frame->pts;
+    raw.is_corrupt_ = (frame->flags & AV_FRAME_FLAG_CORRUPT) != 0;
+    raw.skipped_ = count_delivery(position, last_read_position_);
+
+    for (int plane = 0; plane < raw.num_planes_; plane++) {
+        // planes 1 and 2 of yuv formats hold subsampled chroma
+        bool is_chroma = (plane == 1 || plane == 2) && (desc->flags & AV_PIX_FMT_FLAG_RGB) == 0;
+        raw.data_[plane] = frame->data[plane];
+        raw.stride_[plane] = frame->linesize[plane];
+        raw.row_size_[plane] = av_image_get_linesize(pixfmt, frame->width, plane);
+        raw.rows_[plane] = is_chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+    }
+
+    raw.owner_ = share_videoframe(ref_videoframe(frame));
+    return raw;
+}
+
+uint64_t RtspCameraImpl::count_delivery(Position position, std::optional<Position>& last)
+{
+    frames_delivered_.fetch_add(1, std::memory_order_relaxed);
+    DecoderControl::mark(first_delivery_);
+
+    // covers frames dropped by the subscription and images dropped by the conversion stage, but
+    // not the ones the rate limit dropped
+    uint64_t skipped = 0;
+    if (last && position.frame_index_ > last.value().frame_index_) {
+        uint64_t gap = position.frame_index_ - last.value().frame_index_ - 1;
+        uint64_t decimated = position.decimated_ - last.value().decimated_;
+        skipped = gap - std::min(gap, decimated);
+    }
+    last = position;
+    return skipped;
+}
+
+Image RtspCameraImpl::count_skipped(Image image, uint64_t decimated, std::optional<Position>& last)
+{
+    image.skipped_ = count_delivery({ image.frame_index_, decimated }, last);
+    return image;
 }
 
 void RtspCameraImpl::set_image_format(ImageFormat format)
 {
     if (first_frame_) {
-        switch (format) {
-        case ImageFormat::RGB:
-            pixel_format_ = AV_PIX_FMT_RGB24;
-            break;
-        case ImageFormat::BGR:
-            pixel_format_ = AV_PIX_FMT_BGR24;
-            break;
-        }
+        image_format_ = format;
+        frame_converter_.set_format(format);
+        callback_converter_.set_format(format);
+        update_decode_needs();
     }
 }
 
 void RtspCameraImpl::set_size(int width, int height)
 {
     if (first_frame_) {
-        width_ = width;
-        height_ = height;
+        frame_converter_.set_size(width, height);
+        callback_converter_.set_size(width, height);
     }
 }
 
-Image RtspCameraImpl::read()
+void RtspCameraImpl::set_conversion_threads(int num_threads)
+{
+    if (first_frame_) {
+        num_threads_ = num_threads;
+        frame_converter_.set_threads(num_threads);
+        callback_converter_.set_threads(num_threads);
+    }
+}
+
+void RtspCameraImpl::set_pipelined(bool pipelined)
 {
+    if (first_frame_) {
+        pipelined_ = pipelined;
+    }
+}
+
+void RtspCameraImpl::set_roi(std::optional<Rect> const& roi)
+{
+    std::scoped_lock lock(outputs_mutex_);
+    roi_ = roi;
+}
+
+void RtspCameraImpl::add_output(std::string const& name, OutputSpec const& spec)
+{
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        outputs_.insert_or_assign(name, spec);
+    }
+    update_decode_needs();
+}
+
+void RtspCameraImpl::remove_output(std::string const& name)
+{
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        outputs_.erase(name);
+    }
+    update_decode_needs();
+}
+
+void RtspCameraImpl::set_roi(std::string const& name, Rect const& roi)
+{
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        auto [it, inserted] = outputs_.try_emplace(name, 0, 0, image_format_);
+        it->second.roi_ = roi;
+    }
+    update_decode_needs();
+}
+
+RtspCameraImpl::Position RtspCameraImpl::pop_frame()
+{
+    if (peeked_) {
+        // `video_frame_` still holds the frame
+        auto position = peeked_.value();
+        peeked_.reset();
+        return position;
+    }
+
     for (;;) {
-        auto maybe_image = swapper_.try_pop(std::move(video_frame_), std::chrono::milliseconds(100));
+        session_->client_->touch();
+        uint64_t decimated = 0;
+        auto maybe_image = subscription_->try_pop(std::move(video_frame_), std::chrono::milliseconds(100), &decimated);
         if (!maybe_image) {
             auto maybe_error = error_slot_.check();
             if (maybe_error) {
@@ -112,22 +744,485 @@ Image RtspCameraImpl::read()
         }
 
         video_frame_ = std::move(maybe_image.value().first);
-        auto const* src_frame = video_frame_.get();
+        return { maybe_image.value().second, decimated };
+    }
+}
 
-        if (first_frame_) {
-            auto width = src_frame->width;
-            auto height = src_frame->height;
+void RtspCameraImpl::on_frame(FrameCallback callback, Backpressure backpressure)
+{
+    first_frame_ = false;
+
+    bool is_latest = false;
+    {
+        std::scoped_lock lock(callback_mutex_);
+        if (callback) {
+            frame_callback_ = std::make_shared<FrameCallback const>(std::move(callback));
+        } else {
+            frame_callback_.reset();
+        }
+        backpressure_ = backpressure;
+        is_latest = frame_callback_ && backpressure == Backpressure::LATEST;
 
-            if (width_ == 0 || height_ == 0) {
-                width_ = width;
-                height_ = height;
+        if (holds_awake_ != (frame_callback_ != nullptr)) {
+            holds_awake_ = frame_callback_ != nullptr;
+            session_->client_->hold_awake(holds_awake_);
+        }
+    }
+
+    if (is_latest) {
+        wants_image_.store(true, std::memory_order_relaxed);
+        start_conversion_thread();
+    }
+
+    {
+        // wake the conversion thread, it may be waiting for a reader
+        std::scoped_lock lock(reader_mutex_);
+        has_latest_callback_.store(is_latest, std::memory_order_relaxed);
+    }
+    reader_condvar_.notify_one();
+
+    // a callback already running got the previous one, wait for it unless this is called from it
+    if (callback_thread_.load() != std::this_thread::get_id()) {
+        std::scoped_lock running(callback_run_mutex_);
+    }
+}
+
+void RtspCameraImpl::on_error(ErrorCallback callback)
+{
+    std::shared_ptr<ErrorCallback const> error_callback;
+    if (callback) {
+        error_callback = std::make_shared<ErrorCallback const>(std::move(callback));
+    }
+
+    {
+        std::scoped_lock lock(callback_mutex_);
+        error_callback_ = error_callback;
+    }
+
+    // the stream may already be gone
+    auto maybe_error = error_slot_.check();
+    if (maybe_error && error_callback) {
+        (*error_callback)(maybe_error.value());
+    }
+}
+
+std::shared_ptr<FrameCallback const> RtspCameraImpl::frame_callback(Backpressure backpressure)
+{
+    std::scoped_lock lock(callback_mutex_);
+    if (backpressure_ != backpressure) {
+        return {};
+    }
+    return frame_callback_;
+}
+
+void RtspCameraImpl::on_frame_decoded()
+{
+    // runs on the decoder thread
+    notify_ready();
+    report_started({});
+
+    if (!frame_callback(Backpressure::BLOCK)) {
+        return;
+    }
+
+    // looked up again, `on_frame` may have replaced it before the lock was taken
+    std::scoped_lock running(callback_run_mutex_);
+    auto callback = frame_callback(Backpressure::BLOCK);
+    if (!callback) {
+        return;
+    }
+
+    uint64_t decimated = 0;
+    auto maybe_frame = subscription_->try_pop(std::move(callback_frame_), std::chrono::milliseconds(0), &decimated);
+    if (!maybe_frame) {
+        return;
+    }
+
+    callback_frame_ = std::move(maybe_frame.value().first);
+    run_frame_callback(*callback, callback_frame_.get(), { maybe_frame.value().second, decimated });
+}
+
+void RtspCameraImpl::run_frame_callback(FrameCallback const& callback, AVFrame const* frame, Position position)
+{
+    // `callback_run_mutex_` is held
+    std::optional<Image> image;
+    try {
+        auto converted = convert_image(callback_converter_, frame, position.frame_index_);
+        image = count_skipped(std::move(converted), position.decimated_, last_callback_position_);
+    } catch (std::exception const& e) {
+        error_slot_.set(e.what());
+        return;
+    }
+
+    // a bug in the callback is not a failure of the stream
+    callback_thread_.store(std::this_thread::get_id());
+    try {
+        callback(image.value());
+    } catch (std::exception const& e) {
+        callback_errors_.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "frame callback failed: " << e.what() << std::endl;
+    } catch (...) {
+        callback_errors_.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "frame callback failed" << std::endl;
+    }
+    callback_thread_.store(std::thread::id());
+}
+
+void RtspCameraImpl::report_started(std::optional<std::string> const& error)
+{
+    if (has_started_.load(std::memory_order_relaxed) || has_started_.exchange(true)) {
+        return;
+    }
+
+    if (error) {
+        started_.set_exception(std::make_exception_ptr(std::runtime_error(error.value())));
+    } else {
+        started_.set_value();
+    }
+}
+
+void RtspCameraImpl::on_stream_error(std::string const& error)
+{
+    notify_ready();
+    report_started(error);
+
+    std::shared_ptr<ErrorCallback const> callback;
+    {
+        std::scoped_lock lock(callback_mutex_);
+        callback = error_callback_;
+    }
+
+    if (callback) {
+        (*callback)(error);
+    }
+}
+
+bool RtspCameraImpl::is_ready()
+{
+    // polling counts as interest, a paused stream resumes
+    session_->client_->touch();
+    if (error_slot_.check()) {
+        return true;
+    }
+
+    // in pipelined mode a pending decoded frame counts as well, the conversion stage only runs
+    // for active readers and wakes up on the next `read`
+    return subscription_->has_pending() || (pipelined_ && converted_.has_pending());
+}
+
+void RtspCameraImpl::set_ready_callback(ReadyCallback callback)
+{
+    std::scoped_lock lock(callback_mutex_);
+    if (callback) {
+        ready_callback_ = std::make_shared<ReadyCallback const>(std::move(callback));
+    } else {
+        ready_callback_.reset();
+    }
+}
+
+void RtspCameraImpl::notify_ready()
+{
+    std::shared_ptr<ReadyCallback const> callback;
+    {
+        std::scoped_lock lock(callback_mutex_);
+        callback = ready_callback_;
+    }
+
+    if (callback) {
+        (*callback)();
+    }
+}
+
+void RtspCameraImpl::start_conversion_thread()
+{
+    std::scoped_lock lock(reader_mutex_);
+    if (!conversion_thread_.joinable() && !quit_) {
+        conversion_thread_ = std::thread([this]() { conversion_loop(); });
+    }
+}
+
+RtspCameraImpl::Converted RtspCameraImpl::pop_converted()
+{
+    start_conversion_thread();
+
+    {
+        std::scoped_lock lock(reader_mutex_);
+        last_read_ = std::chrono::steady_clock::now();
+    }
+    reader_condvar_.notify_one();
+
+    for (;;) {
+        session_->client_->touch();
+        auto maybe_converted = converted_.try_pop(Converted {}, std::chrono::milliseconds(100));
+        if (!maybe_converted) {
+            auto maybe_error = error_slot_.check();
+            if (maybe_error) {
+                throw std::runtime_error(maybe_error.value());
             }
+            continue;
+        }
+
+        return std::move(maybe_converted.value().first);
+    }
+}
 
-            video_scaler_.initialize(width, height, (AVPixelFormat)src_frame->format, width_, height_,
-                pixel_format_);
+Image RtspCameraImpl::read()
+{
+    first_frame_ = false;
+
+    if (pipelined_) {
+        if (peeked_image_) {
+            auto image = std::move(peeked_image_.value());
+            peeked_image_.reset();
+            return image;
+        }
+
+        wants_image_.store(true, std::memory_order_relaxed);
+        for (;;) {
+            auto converted = pop_converted();
+            if (converted.image_) {
+                return count_skipped(std::move(converted.image_.value()), converted.decimated_, last_read_position_);
+            }
+        }
+    }
+
+    auto position = pop_frame();
+    auto image = convert_image(frame_converter_, video_frame_.get(), position.frame_index_);
+    return count_skipped(std::move(image), position.decimated_, last_read_position_);
+}
+
+Image RtspCameraImpl::peek()
+{
+    first_frame_ = false;
+
+    if (pipelined_) {
+        // the conversion thread converted the frame already
+        if (!peeked_image_) {
+            peeked_image_ = read();
+        }
+        return peeked_image_.value();
+    }
+
+    if (!peeked_) {
+        peeked_ = pop_frame();
+    }
+
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        frame_converter_.set_roi(roi_);
+    }
+    return frame_converter_.describe(video_frame_.get(), peeked_.value().frame_index_);
+}
+
+std::map<std::string, Image> RtspCameraImpl::read_outputs()
+{
+    first_frame_ = false;
+
+    if (pipelined_) {
+        // the first frames after switching from `read` may have been converted without outputs
+        wants_outputs_.store(true, std::memory_order_relaxed);
+        for (;;) {
+            auto converted = pop_converted();
+            if (converted.outputs_) {
+                return count_skipped(std::move(converted.outputs_.value()), converted.decimated_);
+            }
+        }
+    }
+
+    auto position = pop_frame();
+    return count_skipped(convert_outputs(video_frame_.get(), position.frame_index_), position.decimated_);
+}
+
+std::map<std::string, Image> RtspCameraImpl::count_skipped(std::map<std::string, Image> images, uint64_t decimated)
+{
+    if (images.empty()) {
+        return images;
+    }
+
+    // all outputs come from the same frame
+    uint64_t skipped = count_delivery({ images.begin()->second.frame_index_, decimated }, last_read_position_);
+    for (auto& [name, image] : images) {
+        image.skipped_ = skipped;
+    }
+    return images;
+}
+
+Image RtspCameraImpl::convert_image(FrameConverter& converter, AVFrame const* frame, uint64_t frame_index)
+{
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        converter.set_roi(roi_);
+    }
+
+    return converter.convert(frame, frame_index);
+}
+
+std::map<std::string, Image> RtspCameraImpl::convert_outputs(AVFrame const* frame, uint64_t frame_index)
+{
+    std::map<std::string, OutputSpec> outputs;
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        outputs = outputs_;
+    }
+
+    // drop converters of removed outputs, their scalers are not needed anymore
+    for (auto it = output_converters_.begin(); it != output_converters_.end();) {
+        if (outputs.count(it->first) == 0) {
+            it = output_converters_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    std::map<std::string, Image> images;
+    std::vector<std::pair<OutputSpec const*, Image*>> converted;
+
+    for (auto const& [name, spec] : outputs) {
+        // outputs with identical specs share a single conversion
+        auto same_spec = std::find_if(converted.begin(), converted.end(),
+            [&spec = spec](auto const& item) { return *item.first == spec; });
+        if (same_spec != converted.end()) {
+            same_spec->second->is_shared_ = true;
+            images.emplace(name, *same_spec->second);
+            continue;
+        }
+
+        auto [it, inserted] = output_converters_.try_emplace(name);
+        auto& converter = it->second;
+        if (inserted) {
+            converter.set_threads(num_threads_);
+        }
+        converter.set_spec(spec);
+
+        auto image = images.emplace(name, converter.convert(frame, frame_index)).first;
+        converted.emplace_back(&spec, &image->second);
+    }
+
+    return images;
+}
+
+void RtspCameraImpl::conversion_loop()
+{
+    auto frame = make_videoframe();
+
+    for (;;) {
+        {
+            // Without an active reader the decoder keeps replacing frames in `subscription_`
+            // and nothing is converted. The image converted last is dropped when the reader
+            // goes idle, so a returning reader gets the newest frame converted instead of an old
+            // one, and `is_ready` doesn't report it.
+            std::unique_lock lock(reader_mutex_);
+            auto is_active = [this]() {
+                return quit_ || has_latest_callback_.load(std::memory_order_relaxed)
+                    || std::chrono::steady_clock::now() - last_read_ < reader_idle_timeout;
+            };
+            if (!is_active()) {
+                converted_.try_pop(Converted {}, std::chrono::milliseconds(0));
+                reader_condvar_.wait(lock, is_active);
+            }
+            if (quit_) {
+                break;
+            }
+        }
+
+        uint64_t decimated = 0;
+        auto maybe_frame = subscription_->try_pop(std::move(frame), std::chrono::milliseconds(100), &decimated);
+        if (!maybe_frame) {
+            continue;
+        }
+
+        frame = std::move(maybe_frame.value().first);
+        uint64_t frame_index = maybe_frame.value().second;
+
+        if (has_latest_callback_.load(std::memory_order_relaxed)) {
+            std::scoped_lock running(callback_run_mutex_);
+            if (auto callback = frame_callback(Backpressure::LATEST)) {
+                run_frame_callback(*callback, frame.get(), { frame_index, decimated });
+                continue;
+            }
+        }
+        // the callback was just removed, unless pipelined `read` converts on its own
+        if (!pipelined_) {
+            continue;
+        }
+
+        try {
+            Converted converted;
+            converted.decimated_ = decimated;
+            if (wants_image_.load(std::memory_order_relaxed)) {
+                converted.image_ = convert_image(frame_converter_, frame.get(), frame_index);
+            }
+            if (wants_outputs_.load(std::memory_order_relaxed)) {
+                converted.outputs_ = convert_outputs(frame.get(), frame_index);
+            }
+            // latest wins, an unread image goes back to its pool
+            converted_.push(std::move(converted));
+        } catch (std::exception const& e) {
+            error_slot_.set(e.what());
+            break;
+        }
+    }
+}
+
+Image RtspCameraImpl::read_tensor(void* buffer, size_t size, TensorFormat const& format)
+{
+    if (pipelined_) {
+        // the conversion thread converted the frame already
+        auto image = read();
+        if (tensor_size(image, format) > size) {
+            throw std::runtime_error("Tensor buffer too small");
         }
+        convert_to_tensor(image, format, buffer);
+        return image;
+    }
+    first_frame_ = false;
+
+    auto position = pop_frame();
+    {
+        std::scoped_lock lock(outputs_mutex_);
+        frame_converter_.set_roi(roi_);
+    }
+    auto image = frame_converter_.convert_to_tensor(video_frame_.get(), position.frame_index_, format, buffer, size);
+    return count_skipped(std::move(image), position.decimated_, last_read_position_);
+}
+
+FrameSlot RtspCameraImpl::read_into(uint8_t* buffer, int stride, OutputSpec const& spec)
+{
+    FrameSlot slot;
+    size_t const buffer_size = (size_t)stride * spec.height_;
+
+    if (error_slot_.check()) {
+        std::fill(buffer, buffer + buffer_size, 0);
+        return slot;
+    }
 
-        uint64_t frame_index = maybe_image.value().second;
-        return video_scaler_.convert(src_frame, frame_index);
+    session_->client_->touch();
+    if (spec.format_ != ImageFormat::GRAY && !has_color_batch_.exchange(true, std::memory_order_relaxed)) {
+        update_decode_needs();
     }
+
+    slot.is_stale_ = true;
+    uint64_t decimated = 0;
+    auto maybe_frame = subscription_->try_pop(std::move(batch_frame_), std::chrono::milliseconds(0), &decimated);
+    if (maybe_frame) {
+        batch_frame_ = std::move(maybe_frame.value().first);
+        batch_frame_index_ = maybe_frame.value().second;
+        slot.is_stale_ = false;
+        // a stale slot repeats a frame that was already delivered
+        count_delivery({ batch_frame_index_.value(), decimated }, last_read_position_);
+    }
+
+    if (!batch_frame_index_) {
+        std::fill(buffer, buffer + buffer_size, 0);
+        return slot;
+    }
+
+    batch_converter_.set_threads(1);
+    batch_converter_.set_spec(spec);
+    batch_converter_.convert_into(batch_frame_.get(), buffer, stride);
+
+    slot.frame_index_ = batch_frame_index_.value();
+    slot.timestamp_ = batch_frame_->pts == AV_NOPTS_VALUE ? -1 : batch_frame_->pts;
+    slot.is_missing_ = false;
+    return slot;
 }
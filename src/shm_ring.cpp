@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace rtspcam;
+
+static constexpr uint32_t ring_magic = 0x52435352; // "RCSR"
+static constexpr uint32_t ring_version = 1;
+static constexpr size_t cache_line = 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory needs address-free atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory needs address-free atomics");
+
+namespace rtspcam {
+
+// Layout of the shared memory object, followed by `num_slots_` slots. Every slot is a
+// `ShmSlotHeader` and `slot_size_` bytes of pixels, both starting on a cache line.
+struct alignas(cache_line) ShmRingHeader {
+    uint32_t magic_;
+    uint32_t version_;
+    uint32_t num_slots_;
+    // bumped after every write, readers sleep on it with a futex
+    std::atomic<uint32_t> wakeup_;
+    uint64_t slot_size_;
+    // number of frames written so far
+    std::atomic<uint64_t> written_;
+};
+
+struct alignas(cache_line) ShmSlotHeader {
+    // 2 * sequence + 1 while frame `sequence` is being written, 2 * sequence + 2 once complete
+    std::atomic<uint64_t> state_;
+    uint64_t frame_index_;
+    int64_t timestamp_;
+    uint64_t size_;
+    int32_t width_;
+    int32_t height_;
+    int32_t stride_;
+    int32_t format_;
+};
+
+} // namespace rtspcam
+
+static size_t slot_stride(uint64_t slot_size)
+{
+    return sizeof(ShmSlotHeader) + (slot_size + cache_line - 1) / cache_line * cache_line;
+}
+
+static ShmSlotHeader* slot_at(ShmRingHeader const* header, uint64_t sequence)
+{
+    auto* base = reinterpret_cast<uint8_t*>(const_cast<ShmRingHeader*>(header)) + sizeof(ShmRingHeader);
+    return reinterpret_cast<ShmSlotHeader*>(base + (sequence % header->num_slots_) * slot_stride(header->slot_size_));
+}
+
+static uint8_t* slot_data(ShmSlotHeader* slot)
+{
+    return reinterpret_cast<uint8_t*>(slot) + sizeof(ShmSlotHeader);
+}
+
+static void wake_readers(std::atomic<uint32_t>* word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+static void wait_for_writer(std::atomic<uint32_t> const* word, uint32_t value, std::chrono::milliseconds timeout)
+{
+#ifdef __linux__
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    timespec ts { (time_t)seconds.count(), (long)std::chrono::nanoseconds(timeout - seconds).count() };
+    syscall(SYS_futex, reinterpret_cast<uint32_t const*>(word), FUTEX_WAIT, value, &ts, nullptr, 0);
+#else
+    (void)word;
+    (void)value;
+    std::this_thread::sleep_for(std::min(timeout, std::chrono::milliseconds(1)));
+#endif
+}
+
+ShmRingWriter::ShmRingWriter(std::string const& name, size_t slot_size, int num_slots)
+    : name_(name)
+    , mapping_size_(sizeof(ShmRingHeader) + (size_t)num_slots * slot_stride(slot_size))
+    , header_(nullptr)
+{
+    if (num_slots < 2) {
+        throw std::runtime_error("Shared memory ring needs at least two slots");
+    }
+
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create shared memory object " + name_);
+    }
+
+    if (ftruncate(fd, (off_t)mapping_size_) != 0) {
+        close(fd);
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to size shared memory object " + name_);
+    }
+
+    void* mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("Failed to map shared memory object " + name_);
+    }
+
+    // a fresh object is zero filled, which already is a valid empty ring apart from the header
+    header_ = new (mapping) ShmRingHeader;
+    header_->num_slots_ = (uint32_t)num_slots;
+    header_->slot_size_ = slot_size;
+    header_->wakeup_.store(0, std::memory_order_relaxed);
+    header_->written_.store(0, std::memory_order_relaxed);
+    header_->version_ = ring_version;
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic_ = ring_magic;
+}
+
+ShmRingWriter::~ShmRingWriter()
+{
+    munmap(header_, mapping_size_);
+    shm_unlink(name_.c_str());
+}
+
+void ShmRingWriter::write(Image const& image)
+{
+    size_t const row_size = (size_t)image.width_ * image.channels();
+    size_t const size = row_size * image.height_;
+    if (size > header_->slot_size_) {
+        throw std::runtime_error("Image does not fit into shared memory slot");
+    }
+
+    uint64_t const sequence = header_->written_.load(std::memory_order_relaxed);
+    auto* slot = slot_at(header_, sequence);
+
+    // readers seeing an odd state, or a different one after reading, discard the slot
+    slot->state_.store(2 * sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto* dst = slot_data(slot);
+    for (int y = 0; y < image.height_; y++) {
+        std::memcpy(dst + y * row_size, image.data_ + (size_t)y * image.stride_, row_size);
+    }
+
+    slot->frame_index_ = image.frame_index_;
+    slot->timestamp_ = image.timestamp_;
+    slot->size_ = size;
+    slot->width_ = image.width_;
+    slot->height_ = image.height_;
+    slot->stride_ = (int32_t)row_size;
+    slot->format_ = (int32_t)image.format_;
+
+    slot->state_.store(2 * sequence + 2, std::memory_order_release);
+    header_->written_.store(sequence + 1, std::memory_order_release);
+
+    header_->wakeup_.fetch_add(1, std::memory_order_release);
+    wake_readers(&header_->wakeup_);
+}
+
+ShmRingReader::ShmRingReader(std::string const& name)
+    : mapping_size_(0)
+    , header_(nullptr)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open shared memory object " + name);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+        close(fd);
+        throw std::runtime_error("Shared memory object " + name + " is not a frame ring");
+    }
+    mapping_size_ = (size_t)st.st_size;
+
+    void* mapping = mmap(nullptr, mapping_size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Failed to map shared memory object " + name);
+    }
+
+    header_ = static_cast<ShmRingHeader const*>(mapping);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->magic_ != ring_magic || header_->version_ != ring_version
+        || sizeof(ShmRingHeader) + header_->num_slots_ * slot_stride(header_->slot_size_) > mapping_size_) {
+        munmap(mapping, mapping_size_);
+        throw std::runtime_error("Shared memory object " + name + " is not a frame ring");
+    }
+}
+
+ShmRingReader::~ShmRingReader()
+{
+    munmap(const_cast<ShmRingHeader*>(header_), mapping_size_);
+}
+
+std::optional<ShmFrame> ShmRingReader::latest() const
+{
+    for (;;) {
+        uint64_t const written = header_->written_.load(std::memory_order_acquire);
+        if (written == 0) {
+            return {};
+        }
+
+        uint64_t const sequence = written - 1;
+        auto const* slot = slot_at(header_, sequence);
+        if (slot->state_.load(std::memory_order_acquire) != 2 * sequence + 2) {
+            // lapped by the writer while looking, the next newest frame is complete by now
+            continue;
+        }
+
+        ShmFrame frame {
+            slot_data(const_cast<ShmSlotHeader*>(slot)),
+            slot->size_,
+            sequence,
+            slot->frame_index_,
+            slot->timestamp_,
+            slot->width_,
+            slot->height_,
+            slot->stride_,
+            (ImageFormat)slot->format_,
+        };
+
+        if (is_intact(frame)) {
+            return frame;
+        }
+    }
+}
+
+std::optional<ShmFrame> ShmRingReader::wait(std::optional<uint64_t> sequence, std::chrono::milliseconds timeout) const
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    for (;;) {
+        // read before checking, so that a write in between makes the futex return right away
+        uint32_t wakeup = header_->wakeup_.load(std::memory_order_acquire);
+
+        auto frame = latest();
+        if (frame && (!sequence || frame->sequence_ > sequence.value())) {
+            return frame;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return {};
+        }
+
+        wait_for_writer(&header_->wakeup_, wakeup,
+            std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1));
+    }
+}
+
+bool ShmRingReader::is_intact(ShmFrame const& frame) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    auto const* slot = slot_at(header_, frame.sequence_);
+    return slot->state_.load(std::memory_order_relaxed) == 2 * frame.sequence_ + 2;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "image.hpp"
+
+namespace rtspcam {
+
+struct ShmRingHeader;
+
+// A frame in a reader's mapping of the ring. `data_` points into shared memory and stays intact
+// until the writer comes around to the same slot again, see `ShmRingReader::is_intact`.
+struct ShmFrame {
+    uint8_t const* data_;
+    size_t size_;
+    // Position of the frame in the ring's stream, 0 for the first one written.
+    uint64_t sequence_;
+    uint64_t frame_index_;
+    int64_t timestamp_;
+    int width_;
+    int height_;
+    int stride_;
+    ImageFormat format_;
+};
+
+// Publishes images into a POSIX shared memory object that other processes map read-only. Every
+// slot is a seqlock: readers never block the writer and detect a slot that was overwritten while
+// they looked at it. Not available on Windows.
+class ShmRingWriter {
+public:
+    // Creates shared memory object `name` (e.g. "/cam0") of `num_slots` slots of up to
+    // `slot_size` bytes of pixels each. An existing object of the same name is replaced.
+    ShmRingWriter(std::string const& name, size_t slot_size, int num_slots = 4);
+    // Unlinks the object, readers that mapped it keep their mapping.
+    ~ShmRingWriter();
+
+    ShmRingWriter(ShmRingWriter const&) = delete;
+    ShmRingWriter& operator=(ShmRingWriter const&) = delete;
+
+    // Copies `image` into the next slot, rows are packed without padding.
+    void write(Image const& image);
+
+private:
+    std::string name_;
+    size_t mapping_size_;
+    ShmRingHeader* header_;
+};
+
+class ShmRingReader {
+public:
+    explicit ShmRingReader(std::string const& name);
+    ~ShmRingReader();
+
+    ShmRingReader(ShmRingReader const&) = delete;
+    ShmRingReader& operator=(ShmRingReader const&) = delete;
+
+    // Returns the newest complete frame, if any was written yet. Does not copy pixels.
+    std::optional<ShmFrame> latest() const;
+    // Waits for a frame newer than `sequence` and returns the newest one, or nothing on timeout.
+    std::optional<ShmFrame> wait(std::optional<uint64_t> sequence, std::chrono::milliseconds timeout) const;
+    // Returns whether the pixels of `frame` are still the ones that were written, call it after
+    // using (or copying) them.
+    bool is_intact(ShmFrame const& frame) const;
+
+private:
+    size_t mapping_size_;
+    ShmRingHeader const* header_;
+};
+
+} // namespace rtspcam
@@ -8,6 +8,7 @@
 
 #include <condition_variable>
 #include <cstdint>
+#include <functional>
 #include <mutex>
 #include <optional>
 #include <utility>
@@ -38,9 +39,28 @@ public:
             condvar_.notify_one();
         }
 
+        if (listener_) {
+            listener_();
+        }
+
         return std::move(item);
     }
 
+    // Sets a function called on the pushing thread after every push, without holding the lock.
+    // Must be set before the first push.
+    void set_listener(std::function<void()> listener)
+    {
+        listener_ = std::move(listener);
+    }
+
+    // Returns whether an item was pushed since the last pop, i.e. whether `pop` would return
+    // without waiting.
+    bool has_pending()
+    {
+        std::scoped_lock lock(mutex_);
+        return pop_counter_ != push_counter_;
+    }
+
     std::pair<T, uint64_t> pop(T&& item)
     {
         std::unique_lock lock(mutex_);
@@ -75,4 +95,5 @@ private:
     std::mutex mutex_;
     std::condition_variable condvar_;
     bool is_waiting_;
+    std::function<void()> listener_;
 };
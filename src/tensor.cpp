@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include "tensor.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+using namespace rtspcam;
+
+static uint16_t float_to_half(float value);
+
+namespace {
+
+template<typename T>
+struct Element;
+
+template<>
+struct Element<float> {
+    static float from(float value) { return value; }
+};
+
+template<>
+struct Element<uint16_t> {
+    static uint16_t from(float value) { return float_to_half(value); }
+};
+
+// These run over an image libswscale already produced, when the frame can't be converted by
+// `convert_yuv420`. NCHW reads each channel with a stride of C bytes.
+template<typename T, int C>
+void convert_nchw(Image const& image, float const* scale, float const* bias, T* __restrict dst)
+{
+    size_t const plane_size = (size_t)image.width_ * image.height_;
+
+    for (int y = 0; y < image.height_; y++) {
+        uint8_t const* __restrict src = image.data_ + (size_t)y * image.stride_;
+        for (int c = 0; c < C; c++) {
+            T* __restrict out = dst + c * plane_size + (size_t)y * image.width_;
+            float const s = scale[c];
+            float const b = bias[c];
+            for (int x = 0; x < image.width_; x++) {
+                out[x] = Element<T>::from((float)src[x * C + c] * s + b);
+            }
+        }
+    }
+}
+
+template<typename T, int C>
+void convert_nhwc(Image const& image, float const* scale, float const* bias, T* __restrict dst)
+{
+    for (int y = 0; y < image.height_; y++) {
+        uint8_t const* __restrict src = image.data_ + (size_t)y * image.stride_;
+        T* __restrict out = dst + (size_t)y * image.width_ * C;
+        for (int x = 0; x < image.width_; x++) {
+            for (int c = 0; c < C; c++) {
+                out[x * C + c] = Element<T>::from((float)src[x * C + c] * scale[c] + bias[c]);
+            }
+        }
+    }
+}
+
+template<typename T, int C>
+void convert(Image const& image, TensorLayout layout, float const* scale, float const* bias, void* dst)
+{
+    switch (layout) {
+    case TensorLayout::NCHW:
+        convert_nchw<T, C>(image, scale, bias, static_cast<T*>(dst));
+        break;
+    case TensorLayout::NHWC:
+        convert_nhwc<T, C>(image, scale, bias, static_cast<T*>(dst));
+        break;
+    }
+}
+
+template<typename T>
+void convert(Image const& image, TensorLayout layout, float const* scale, float const* bias, void* dst)
+{
+    if (image.channels() == 1) {
+        convert<T, 1>(image, layout, scale, bias, dst);
+    } else {
+        convert<T, 3>(image, layout, scale, bias, dst);
+    }
+}
+
+
+// Taps of a resize along one axis, `num_taps_` source indices and weights per output coordinate.
+// A tent filter, widened by the scale factor when shrinking so that every source sample counts.
+// Indices are clamped to the source, weights sum to one.
+struct ResizeTaps {
+    ResizeTaps(int src_size, int dst_size)
+    {
+        double const scale = (double)src_size / dst_size;
+        double const radius = std::max(1.0, scale);
+        num_taps_ = (int)std::ceil(2.0 * radius) + 1;
+        index_.resize((size_t)dst_size * num_taps_);
+        weight_.resize((size_t)dst_size * num_taps_);
+
+        for (int i = 0; i < dst_size; i++) {
+            double const center = (i + 0.5) * scale - 0.5;
+            int const first = (int)std::floor(center - radius) + 1;
+            double sum = 0.0;
+            for (int k = 0; k < num_taps_; k++) {
+                double const weight = std::max(0.0, 1.0 - std::abs(first + k - center) / radius);
+                index_[(size_t)i * num_taps_ + k] = std::clamp(first + k, 0, src_size - 1);
+                weight_[(size_t)i * num_taps_ + k] = (float)weight;
+                sum += weight;
+            }
+            for (int k = 0; k < num_taps_; k++) {
+                weight_[(size_t)i * num_taps_ + k] /= (float)sum;
+            }
+        }
+    }
+
+    int num_taps_;
+    std::vector<int> index_;
+    std::vector<float> weight_;
+};
+
+// Blends the source rows of output row `i` into `out`, `count` samples `step` bytes apart.
+void blend_rows(uint8_t const* plane, int stride, int step, int count, ResizeTaps const& taps, int i,
+    float* __restrict out)
+{
+    std::fill(out, out + count, 0.0f);
+    for (int k = 0; k < taps.num_taps_; k++) {
+        float const weight = taps.weight_[(size_t)i * taps.num_taps_ + k];
+        if (weight == 0.0f) {
+            continue;
+        }
+        uint8_t const* __restrict src = plane + (size_t)taps.index_[(size_t)i * taps.num_taps_ + k] * stride;
+        for (int x = 0; x < count; x++) {
+            out[x] += weight * (float)src[x * step];
+        }
+    }
+}
+
+void resample_row(float const* __restrict row, ResizeTaps const& taps, int count, float* __restrict out)
+{
+    int const* index = taps.index_.data();
+    float const* weight = taps.weight_.data();
+    for (int x = 0; x < count; x++) {
+        float sum = 0.0f;
+        for (int k = 0; k < taps.num_taps_; k++) {
+            sum += row[index[k]] * weight[k];
+        }
+        out[x] = sum;
+        index += taps.num_taps_;
+        weight += taps.num_taps_;
+    }
+}
+
+// Output row `y`: resized luma and chroma are gathered into rows of floats, then a single
+// branch-free loop converts them to RGB, normalizes and stores every element.
+template<typename T>
+void convert_yuv420(Yuv420Planes const& planes, Image const& image, TensorLayout layout,
+    float const* scale, float const* bias, T* __restrict dst)
+{
+    int const width = image.width_;
+    int const height = image.height_;
+    int const chroma_width = (planes.width_ + 1) / 2;
+    int const chroma_height = (planes.height_ + 1) / 2;
+    bool const is_gray = image.format_ == ImageFormat::GRAY;
+    int const channels = is_gray ? 1 : 3;
+
+    ResizeTaps const luma_x(planes.width_, width);
+    ResizeTaps const luma_y(planes.height_, height);
+    std::optional<ResizeTaps> chroma_x;
+    std::optional<ResizeTaps> chroma_y;
+    if (!is_gray) {
+        chroma_x.emplace(chroma_width, width);
+        chroma_y.emplace(chroma_height, height);
+    }
+
+    std::vector<float> rows((size_t)planes.width_ + 2 * chroma_width + 3 * width);
+    float* y_row = rows.data();
+    float* u_row = y_row + planes.width_;
+    float* v_row = u_row + chroma_width;
+    float* luma = v_row + chroma_width;
+    float* cb = luma + width;
+    float* cr = cb + width;
+
+    // Limited range is stretched to 0-255 for RGB. GRAY keeps luma as decoded, like libswscale
+    // and the zero-copy luma image.
+    float const luma_gain = planes.is_full_range_ || is_gray ? 1.0f : 255.0f / 219.0f;
+    float const luma_offset = planes.is_full_range_ || is_gray ? 0.0f : 16.0f;
+    float const chroma_gain = planes.is_full_range_ ? 1.0f : 255.0f / 224.0f;
+
+    // tensor channel c is red, green or blue in the order of the image format
+    int const red = image.format_ == ImageFormat::BGR ? 2 : 0;
+    int const blue = 2 - red;
+    size_t const channel_step = layout == TensorLayout::NCHW ? (size_t)width * height : 1;
+    size_t const pixel_step = layout == TensorLayout::NCHW ? 1 : channels;
+
+    for (int y = 0; y < height; y++) {
+        T* __restrict out = dst + (size_t)y * width * (layout == TensorLayout::NCHW ? 1 : channels);
+
+        blend_rows(planes.y_, planes.y_stride_, 1, planes.width_, luma_y, y, y_row);
+        resample_row(y_row, luma_x, width, luma);
+
+        if (is_gray) {
+            for (int x = 0; x < width; x++) {
+                float const value = std::clamp(luma[x], 0.0f, 255.0f);
+                out[x * pixel_step] = Element<T>::from(value * scale[0] + bias[0]);
+            }
+            continue;
+        }
+
+        if (planes.is_nv12_) {
+            blend_rows(planes.u_, planes.uv_stride_, 2, chroma_width, *chroma_y, y, u_row);
+            blend_rows(planes.u_ + 1, planes.uv_stride_, 2, chroma_width, *chroma_y, y, v_row);
+        } else {
+            blend_rows(planes.u_, planes.uv_stride_, 1, chroma_width, *chroma_y, y, u_row);
+            blend_rows(planes.v_, planes.uv_stride_, 1, chroma_width, *chroma_y, y, v_row);
+        }
+        resample_row(u_row, *chroma_x, width, cb);
+        resample_row(v_row, *chroma_x, width, cr);
+
+        T* __restrict out_red = out + red * channel_step;
+        T* __restrict out_green = out + channel_step;
+        T* __restrict out_blue = out + blue * channel_step;
+        for (int x = 0; x < width; x++) {
+            float const l = (luma[x] - luma_offset) * luma_gain;
+            float const u = (cb[x] - 128.0f) * chroma_gain;
+            float const v = (cr[x] - 128.0f) * chroma_gain;
+            float const r = std::clamp(l + 1.402f * v, 0.0f, 255.0f);
+            float const g = std::clamp(l - 0.344136f * u - 0.714136f * v, 0.0f, 255.0f);
+            float const b = std::clamp(l + 1.772f * u, 0.0f, 255.0f);
+            out_red[x * pixel_step] = Element<T>::from(r * scale[red] + bias[red]);
+            out_green[x * pixel_step] = Element<T>::from(g * scale[1] + bias[1]);
+            out_blue[x * pixel_step] = Element<T>::from(b * scale[blue] + bias[blue]);
+        }
+    }
+}
+
+// Folds `(pixel / 255 - mean) / std` into a single multiply-add per element.
+void fold_normalization(TensorFormat const& format, float* scale, float* bias)
+{
+    for (int c = 0; c < 3; c++) {
+        if (format.std_[c] == 0.0f) {
+            throw std::runtime_error("Tensor standard deviation must not be zero");
+        }
+        scale[c] = 1.0f / (255.0f * format.std_[c]);
+        bias[c] = -format.mean_[c] / format.std_[c];
+    }
+}
+
+} // namespace
+
+size_t rtspcam::tensor_size(Image const& image, TensorFormat const& format)
+{
+    size_t element_size = format.type_ == TensorType::FLOAT32 ? sizeof(float) : sizeof(uint16_t);
+    return (size_t)image.width_ * image.height_ * image.channels() * element_size;
+}
+
+void rtspcam::convert_to_tensor(Image const& image, TensorFormat const& format, void* dst)
+{
+    float scale[3];
+    float bias[3];
+    fold_normalization(format, scale, bias);
+
+    switch (format.type_) {
+    case TensorType::FLOAT32:
+        convert<float>(image, format.layout_, scale, bias, dst);
+        break;
+    case TensorType::FLOAT16:
+        convert<uint16_t>(image, format.layout_, scale, bias, dst);
+        break;
+    }
+}
+
+void rtspcam::convert_to_tensor(Yuv420Planes const& planes, Image const& image, TensorFormat const& format, void* dst)
+{
+    float scale[3];
+    float bias[3];
+    fold_normalization(format, scale, bias);
+
+    switch (format.type_) {
+    case TensorType::FLOAT32:
+        convert_yuv420<float>(planes, image, format.layout_, scale, bias, static_cast<float*>(dst));
+        break;
+    case TensorType::FLOAT16:
+        convert_yuv420<uint16_t>(planes, image, format.layout_, scale, bias, static_cast<uint16_t*>(dst));
+        break;
+    }
+}
+
+static uint16_t float_to_half(float value)
+{
+    // IEEE 754 binary16 with round-to-nearest-even. Every case is computed and the result picked
+    // with selects, so that loops converting whole rows vectorize.
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t const sign = (bits >> 16) & 0x8000;
+    uint32_t const magnitude = bits & 0x7fffffff;
+
+    // rebias the exponent and round away the 13 low mantissa bits, a carry into the exponent is
+    // still the correctly rounded result
+    uint32_t const normal = (magnitude - ((127u - 15u) << 23) + 0xfff + ((magnitude >> 13) & 1)) >> 13;
+
+    // below 2^-14, adding 0.5 lets the fpu shift and round the mantissa into the low bits
+    float subnormal_value;
+    std::memcpy(&subnormal_value, &magnitude, sizeof(subnormal_value));
+    subnormal_value += 0.5f;
+    uint32_t subnormal;
+    std::memcpy(&subnormal, &subnormal_value, sizeof(subnormal));
+    subnormal -= 0x3f000000;
+
+    // overflow and infinity, nan stays a (quiet) nan
+    uint32_t const special = magnitude > 0x7f800000 ? 0x7e00 : 0x7c00;
+
+    uint32_t half = magnitude < 0x38800000 ? subnormal : normal;
+    half = magnitude >= 0x47800000 ? special : half;
+    return (uint16_t)(sign | half);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022, Bostjan Vesnicer
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "image.hpp"
+
+namespace rtspcam {
+
+enum class TensorLayout {
+    NCHW,
+    NHWC,
+};
+
+enum class TensorType {
+    FLOAT32,
+    FLOAT16,
+};
+
+// Describes how an image is turned into a network input. Every element is computed as
+// `(pixel / 255 - mean_[c]) / std_[c]`, where channels are ordered as in the source image.
+struct TensorFormat {
+    TensorFormat(TensorLayout layout = TensorLayout::NCHW,
+        TensorType type = TensorType::FLOAT32,
+        std::array<float, 3> mean = { 0.0f, 0.0f, 0.0f },
+        std::array<float, 3> std = { 1.0f, 1.0f, 1.0f })
+        : layout_(layout)
+        , type_(type)
+        , mean_(mean)
+        , std_(std)
+    {
+    }
+
+    TensorLayout layout_;
+    TensorType type_;
+    std::array<float, 3> mean_;
+    std::array<float, 3> std_;
+};
+
+// Planes of an 8-bit 4:2:0 frame, three planes or NV12 with U and V interleaved in `u_`.
+struct Yuv420Planes {
+    uint8_t const* y_;
+    uint8_t const* u_;
+    uint8_t const* v_;
+    int y_stride_;
+    int uv_stride_;
+    int width_;
+    int height_;
+    bool is_nv12_;
+    // JPEG range, luma is not stretched from 16-235
+    bool is_full_range_;
+};
+
+// Returns number of bytes needed to hold `image` converted to `format`.
+size_t tensor_size(Image const& image, TensorFormat const& format);
+
+// Normalizes, reorders and converts `image` to `format`.
+// `dst` must hold at least `tensor_size(image, format)` bytes.
+void convert_to_tensor(Image const& image, TensorFormat const& format, void* dst);
+
+// Resizes `planes` to the size of `image`, converts them to its format and writes the result as
+// a tensor of `format`, one output row at a time and without an intermediate image. Only the
+// geometry and format of `image` are used. Resizing is bilinear, widened when shrinking like
+// libswscale's, colours are BT.601 like libswscale's default.
+void convert_to_tensor(Yuv420Planes const& planes, Image const& image, TensorFormat const& format, void* dst);
+
+} // namespace rtspcam
@@ -7,6 +7,7 @@
 #pragma once
 
 #include <memory>
+#include <stdexcept>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -25,4 +26,20 @@ inline VideoFramePtr make_videoframe()
     return { av_frame_alloc(), AVFrameDeleter() };
 }
 
+// Returns a new reference to the buffers of `frame`. No pixels are copied.
+inline VideoFramePtr ref_videoframe(AVFrame const* frame)
+{
+    auto ref = make_videoframe();
+    if (!ref || av_frame_ref(ref.get(), frame) != 0) {
+        throw std::runtime_error("Failed to reference video frame");
+    }
+    return ref;
+}
+
+// Type-erased owner of a frame's buffers, used to keep image data alive.
+inline std::shared_ptr<void> share_videoframe(VideoFramePtr&& frame)
+{
+    return std::shared_ptr<AVFrame>(frame.release(), AVFrameDeleter());
+}
+
 } // namespace rtspcam
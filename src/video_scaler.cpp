@@ -11,25 +11,50 @@
 
 extern "C" {
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 }
 
 using namespace rtspcam;
 
 static std::pair<AVPixelFormat, bool> maybe_change_pixel_format(AVPixelFormat pixfmt);
+static ImageFormat to_image_format(AVPixelFormat pixfmt);
+static SwsContext* create_sws_context(int src_width, int src_height, AVPixelFormat src_pixfmt,
+    int dst_width, int dst_height, AVPixelFormat dst_pixfmt, int num_threads);
+
+// row alignment of pooled buffers, keeps simd paths of libswscale enabled
+static constexpr int buffer_align = 32;
+
+VideoScaler::VideoScaler()
+    : dst_pixfmt_(AV_PIX_FMT_NONE)
+    , dst_width_(0)
+    , dst_height_(0)
+    , dst_format_(ImageFormat::RGB)
+    , is_threaded_(false)
+{
+}
 
 void VideoScaler::initialize(int src_width,
     int src_height,
     AVPixelFormat src_pixfmt,
     int dst_width,
     int dst_height,
-    AVPixelFormat dst_pixfmt)
+    AVPixelFormat dst_pixfmt,
+    int num_threads)
 {
     bool should_change_colorspace_details;
     std::tie(src_pixfmt, should_change_colorspace_details) = maybe_change_pixel_format(src_pixfmt);
 
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    is_threaded_ = num_threads != 1;
+#else
+    // slice threading needs libswscale 6 (FFmpeg 5.0)
+    is_threaded_ = false;
+    num_threads = 1;
+#endif
+
     sws_context_ = std::unique_ptr<SwsContext, SwsContextDeleter>(
-        sws_getContext(src_width, src_height, src_pixfmt, dst_width, dst_height, dst_pixfmt,
-            SWS_BILINEAR, nullptr, nullptr, nullptr),
+        create_sws_context(src_width, src_height, src_pixfmt, dst_width, dst_height, dst_pixfmt,
+            num_threads),
         SwsContextDeleter());
     if (!sws_context_) {
         throw std::runtime_error("Failed to initialize video scaler");
@@ -65,22 +90,41 @@ void VideoScaler::initialize(int src_width,
         }
     }
 
-    dst_frame_ = make_videoframe();
-    auto* dst_frame = dst_frame_.get();
+    dst_format_ = to_image_format(dst_pixfmt);
+    dst_pixfmt_ = dst_pixfmt;
+    dst_width_ = dst_width;
+    dst_height_ = dst_height;
 
-    // allocate destination buffer
-    // int num_bytes = av_image_get_buffer_size(AV_PIX_FMT_RGB24, dst_width, dst_height, 0);
-    dst_frame->format = AV_PIX_FMT_RGB24;
-    dst_frame->width = dst_width;
-    dst_frame->height = dst_height;
-    if (av_frame_get_buffer(dst_frame, 0) != 0) {
-        throw std::runtime_error("Failed to allocate buffer for frame");
+    // buffers still referenced by images keep the old pool alive until they are released
+    int buffer_size = av_image_get_buffer_size(dst_pixfmt, dst_width, dst_height, buffer_align);
+    if (buffer_size < 0) {
+        throw std::runtime_error("Failed to compute size of frame buffer");
+    }
+    buffer_pool_ = std::unique_ptr<AVBufferPool, AVBufferPoolDeleter>(
+        av_buffer_pool_init(buffer_size, av_buffer_alloc), AVBufferPoolDeleter());
+    if (!buffer_pool_) {
+        throw std::runtime_error("Failed to allocate buffer pool");
     }
 }
 
 Image VideoScaler::convert(AVFrame const* src_frame, uint64_t frame_index)
 {
-    auto* dst_frame = dst_frame_.get();
+    auto dst_frame_ptr = allocate_frame();
+    auto* dst_frame = dst_frame_ptr.get();
+
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    if (is_threaded_) {
+        // the legacy sws_scale() api always runs on the calling thread, only the frame api
+        // dispatches slices to the context's worker threads
+        if (sws_scale_frame(sws_context_.get(), dst_frame, src_frame) < 0) {
+            throw std::runtime_error("Failed to scale video frame");
+        }
+
+        return Image(dst_frame->data[0], (size_t)dst_frame->linesize[0] * dst_frame->height,
+            frame_index, dst_frame->width, dst_frame->height, dst_frame->linesize[0], dst_format_,
+            share_videoframe(std::move(dst_frame_ptr)));
+    }
+#endif
 
     if (sws_scale(sws_context_.get(), src_frame->data, src_frame->linesize, 0, src_frame->height,
             dst_frame->data, dst_frame->linesize)
@@ -92,7 +136,82 @@ Image VideoScaler::convert(AVFrame const* src_frame, uint64_t frame_index)
     }
 
     return Image(dst_frame->data[0], (size_t)dst_frame->linesize[0] * dst_frame->height, frame_index,
-        dst_frame->width, dst_frame->height, dst_frame->linesize[0]);
+        dst_frame->width, dst_frame->height, dst_frame->linesize[0], dst_format_,
+        share_videoframe(std::move(dst_frame_ptr)));
+}
+
+void VideoScaler::convert_into(AVFrame const* src_frame, uint8_t* dst, int dst_stride)
+{
+    // sws_scale_frame() would allocate its own destination, so slice threads are not used here
+    uint8_t* dst_data[4] = { dst, nullptr, nullptr, nullptr };
+    int dst_linesize[4] = { dst_stride, 0, 0, 0 };
+
+    if (sws_scale(sws_context_.get(), src_frame->data, src_frame->linesize, 0, src_frame->height,
+            dst_data, dst_linesize)
+        != dst_height_) {
+        throw std::runtime_error("Failed to scale video frame");
+    }
+}
+
+VideoFramePtr VideoScaler::allocate_frame()
+{
+    auto frame = make_videoframe();
+    if (!frame) {
+        throw std::runtime_error("Failed to allocate frame");
+    }
+
+    frame->format = dst_pixfmt_;
+    frame->width = dst_width_;
+    frame->height = dst_height_;
+    frame->buf[0] = av_buffer_pool_get(buffer_pool_.get());
+    if (!frame->buf[0]) {
+        throw std::runtime_error("Failed to allocate buffer for frame");
+    }
+
+    if (av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, dst_pixfmt_,
+            dst_width_, dst_height_, buffer_align)
+        < 0) {
+        throw std::runtime_error("Failed to set up frame buffer");
+    }
+
+    return frame;
+}
+
+static SwsContext* create_sws_context(int src_width,
+    int src_height,
+    AVPixelFormat src_pixfmt,
+    int dst_width,
+    int dst_height,
+    AVPixelFormat dst_pixfmt,
+    int num_threads)
+{
+    if (num_threads == 1) {
+        return sws_getContext(src_width, src_height, src_pixfmt, dst_width, dst_height, dst_pixfmt,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+    }
+
+    // Slices are cut by libswscale itself, so vertical filter taps that straddle a slice boundary
+    // see the same input rows as in the single threaded case and the output is bit-identical.
+    SwsContext* sws_context = sws_alloc_context();
+    if (!sws_context) {
+        return nullptr;
+    }
+
+    av_opt_set_int(sws_context, "srcw", src_width, 0);
+    av_opt_set_int(sws_context, "srch", src_height, 0);
+    av_opt_set_int(sws_context, "src_format", src_pixfmt, 0);
+    av_opt_set_int(sws_context, "dstw", dst_width, 0);
+    av_opt_set_int(sws_context, "dsth", dst_height, 0);
+    av_opt_set_int(sws_context, "dst_format", dst_pixfmt, 0);
+    av_opt_set_int(sws_context, "sws_flags", SWS_BILINEAR, 0);
+    av_opt_set_int(sws_context, "threads", num_threads, 0);
+
+    if (sws_init_context(sws_context, nullptr, nullptr) < 0) {
+        sws_freeContext(sws_context);
+        return nullptr;
+    }
+
+    return sws_context;
 }
 
 static std::pair<AVPixelFormat, bool> maybe_change_pixel_format(AVPixelFormat pixfmt)
@@ -125,3 +244,17 @@ static std::pair<AVPixelFormat, bool> maybe_change_pixel_format(AVPixelFormat pi
 
     return { dst_pixfmt, change_colorspace_details };
 }
+
+static ImageFormat to_image_format(AVPixelFormat pixfmt)
+{
+    switch (pixfmt) {
+    case AV_PIX_FMT_RGB24:
+        return ImageFormat::RGB;
+    case AV_PIX_FMT_BGR24:
+        return ImageFormat::BGR;
+    case AV_PIX_FMT_GRAY8:
+        return ImageFormat::GRAY;
+    default:
+        throw std::runtime_error("Unsupported output pixel format");
+    }
+}
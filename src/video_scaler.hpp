@@ -9,6 +9,7 @@
 #include <memory>
 
 extern "C" {
+#include <libavutil/buffer.h>
 #include <libswscale/swscale.h>
 }
 
@@ -20,16 +21,34 @@ namespace rtspcam {
 struct SwsContextDeleter {
     void operator()(SwsContext* p) const { sws_freeContext(p); }
 };
+struct AVBufferPoolDeleter {
+    void operator()(AVBufferPool* p) const { av_buffer_pool_uninit(&p); }
+};
 
 class VideoScaler {
 public:
+    VideoScaler();
+
+    // `num_threads` splits conversion into horizontal slices processed in parallel by libswscale.
+    // 1 converts on the calling thread, 0 uses one thread per core.
     void initialize(int src_width, int src_height, AVPixelFormat src_pixfmt,
-        int dst_width, int dst_height, AVPixelFormat dst_pixfmt);
+        int dst_width, int dst_height, AVPixelFormat dst_pixfmt, int num_threads = 1);
+    // Every image gets its own buffer from a pool, so it stays valid after further conversions.
     Image convert(AVFrame const* src_frame, uint64_t frame_index);
+    // Writes the converted image to caller owned memory with rows `dst_stride` bytes apart. Always
+    // runs on the calling thread.
+    void convert_into(AVFrame const* src_frame, uint8_t* dst, int dst_stride);
 
 private:
+    VideoFramePtr allocate_frame();
+
     std::unique_ptr<SwsContext, SwsContextDeleter> sws_context_;
-    VideoFramePtr dst_frame_;
+    std::unique_ptr<AVBufferPool, AVBufferPoolDeleter> buffer_pool_;
+    AVPixelFormat dst_pixfmt_;
+    int dst_width_;
+    int dst_height_;
+    ImageFormat dst_format_;
+    bool is_threaded_;
 };
 
 } // namespace rtspcam